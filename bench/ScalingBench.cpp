@@ -0,0 +1,204 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <sys/resource.h>
+
+#include "TermGenerator.h"
+#include "../src/Parser.h"
+#include "../src/NodeHeap.h"
+
+// Measures how printing, parsing and reducing scale with the size of random
+// terms, from a hundred nodes up to the largest size given, so that paths
+// that grow faster than the terms stand out. The node heap's size after
+// each reduction and the time its collections took are shown as well.
+//
+//   make scaling_bench && ./scaling_bench.out [options]
+//
+//   --max=N        largest term, in nodes (default 1000000)
+//   --seed=N       seed of the generator (default 42)
+//   --nesting=N    deepest chain of nodes (default 200)
+//   --binders=P    chance of an abstraction (default 0.4)
+//   --redexes=P    chance of an application being a redex (default 0.1)
+//   --sharing=P    chance of reusing a subterm (default 0)
+//   --engine=E     tree, compact or graph (default tree)
+//   --steps        reduce step by step, printing every step, as the prompt
+//   --print=P      tree, let or dag, how terms and results are printed
+//   --timeout=MS   time limit of each reduction (default 10000)
+//   --memory=MB    address space the benchmark may use (default 4096)
+//   --csv          comma-separated output, for plotting
+
+static std::string strip_colours(std::string_view text) {
+  std::string plain;
+  plain.reserve(text.size());
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '\x1b') {
+      plain += text[i];
+      continue;
+    }
+    while (i < text.size() and text[i] != 'm') ++i;
+  }
+  return plain;
+}
+
+static std::string to_source(std::string_view text) {
+  // Arguments that are applications themselves are printed in brackets,
+  // which the parser reads as parentheses
+  std::string source = strip_colours(text);
+  std::replace(source.begin(), source.end(), '[', '(');
+  std::replace(source.begin(), source.end(), ']', ')');
+  return source;
+}
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static long peak_rss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static long peak_nodes;
+
+static void record_nodes(const AST::Control &control) {
+  peak_nodes = std::max(peak_nodes, control.nodes);
+}
+
+int main(int argc, const char *argv[]) {
+  TermGenerator::Shape shape;
+  size_t largest = 1000000;
+  uint32_t seed = 42;
+  bool csv = false;
+  bool steps = false;
+  int timeout = 10000;
+  size_t memory = 4096;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = argv[i];
+    if (argument.rfind("--max=", 0) == 0) largest = std::stoul(argument.substr(6));
+    else if (argument.rfind("--seed=", 0) == 0) seed = std::stoul(argument.substr(7));
+    else if (argument.rfind("--nesting=", 0) == 0) shape.nesting = std::stoi(argument.substr(10));
+    else if (argument.rfind("--binders=", 0) == 0) shape.binders = std::stod(argument.substr(10));
+    else if (argument.rfind("--redexes=", 0) == 0) shape.redexes = std::stod(argument.substr(10));
+    else if (argument.rfind("--sharing=", 0) == 0) shape.sharing = std::stod(argument.substr(10));
+    else if (argument == "--engine=tree") AST::set_engine(AST::Engine::Tree);
+    else if (argument == "--engine=compact") AST::set_engine(AST::Engine::Compact);
+    else if (argument == "--engine=graph") AST::set_engine(AST::Engine::Graph);
+    else if (argument == "--steps") steps = true;
+    else if (argument == "--print=tree") AST::set_printing(AST::Printing::Tree);
+    else if (argument == "--print=let") AST::set_printing(AST::Printing::Let);
+    else if (argument == "--print=dag") AST::set_printing(AST::Printing::Dag);
+    else if (argument.rfind("--timeout=", 0) == 0) timeout = std::stoi(argument.substr(10));
+    else if (argument.rfind("--memory=", 0) == 0) memory = std::stoul(argument.substr(9));
+    else if (argument == "--csv") csv = true;
+    else {
+      std::cout << "Unknown option \"" << argument << "\"\n";
+      return 1;
+    }
+  }
+
+  // Reductions that blow up run out of memory with bad_alloc instead of
+  // bringing the whole machine down
+  struct rlimit limit;
+  limit.rlim_cur = limit.rlim_max = memory << 20;
+  setrlimit(RLIMIT_AS, &limit);
+
+  // Everything the evaluator prints goes nowhere, so that only the work of
+  // building the text is measured
+  std::ostream discard(nullptr);
+  AST::init();
+  AST::set_output(discard);
+  AST::set_verbose(steps);
+  AST::set_time_limit(std::chrono::milliseconds(timeout));
+
+  // Progress is reported at every checkpoint, which samples the live nodes
+  // while a reduction runs
+  AST::Control control;
+  control.report = record_nodes;
+  control.interval = std::chrono::milliseconds(0);
+  AST::set_control(&control);
+
+  std::vector<size_t> sizes;
+  for (size_t size = 100; size <= largest; size *= 10) {
+    sizes.push_back(size);
+    if (size * 3 <= largest) sizes.push_back(size * 3);
+  }
+
+  const char *columns[] {
+    "nodes", "chars", "print ms", "parse ms", "reduce ms", "peak nodes", "rss KB", "heap KB", "gc ms", "result"
+  };
+  for (const char *column : columns) {
+    if (csv) std::cout << column << (column == columns[9] ? "\n" : ",");
+    else std::cout << std::setw(12) << column;
+  }
+  if (!csv) std::cout << "\n";
+
+  for (size_t target : sizes) {
+    shape.size = target;
+    size_t size;
+    AST::Node *term = TermGenerator::generate(shape, seed, size);
+
+    // Terms printed with sharing are timed, but only a tree can be parsed
+    auto start = std::chrono::steady_clock::now();
+    std::string printed = AST::to_result_string(term);
+    double print = milliseconds_since(start);
+    std::string text = to_source(AST::to_string(term));
+    term->release();
+
+    start = std::chrono::steady_clock::now();
+    AST::Node *parsed = Parser::parse(text);
+    double parse = milliseconds_since(start);
+    if (!parsed) {
+      std::cout << "Could not parse the term of " << size << " nodes\n";
+      return 1;
+    }
+
+    // The result is printed as part of the reduction, as it is at the
+    // prompt; an empty result means the reduction was stopped
+    peak_nodes = AST::count_nodes();
+    uint64_t paused = NodeHeap::stats().pause_total_us;
+    control.next_report = std::chrono::steady_clock::now();
+    start = std::chrono::steady_clock::now();
+    std::string result;
+    bool exhausted = false;
+    try {
+      result = AST::solve(parsed, text);
+    }
+    catch (const std::bad_alloc &exception) {
+      exhausted = true;
+    }
+    double reduce = milliseconds_since(start);
+    peak_nodes = std::max(peak_nodes, AST::count_nodes());
+    NodeHeap::Stats heap = NodeHeap::stats();
+    double collecting = (heap.pause_total_us - paused) / 1000.0;
+
+    std::string outcome = result == "" ? "stopped" : std::to_string(strip_colours(result).size()) + " chars";
+    if (exhausted) outcome = "no memory";
+    if (csv) {
+      std::cout << size << "," << printed.size() << "," << print << "," << parse << "," << reduce << ","
+        << peak_nodes << "," << peak_rss() << "," << (heap.heap_bytes >> 10) << "," << collecting << ","
+        << outcome << std::endl;
+    }
+    else {
+      std::cout << std::fixed << std::setprecision(2)
+        << std::setw(12) << size << std::setw(12) << printed.size()
+        << std::setw(12) << print << std::setw(12) << parse << std::setw(12) << reduce
+        << std::setw(12) << peak_nodes << std::setw(12) << peak_rss() << std::setw(12) << (heap.heap_bytes >> 10)
+        << std::setw(12) << collecting << std::setw(12) << outcome << std::endl;
+    }
+
+    // An evaluation cut short by bad_alloc leaves its state behind, so the
+    // sizes after it could not be trusted
+    if (exhausted) return 1;
+    parsed->release();
+  }
+
+  AST::set_control(nullptr);
+  AST::end();
+  return 0;
+}
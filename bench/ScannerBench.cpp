@@ -0,0 +1,92 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/Lexer.h"
+#include "../src/Scanner.h"
+
+// Measures Lexer::tokenize throughput for every scanner implementation
+// supported by this CPU.
+//
+//   make scanner_bench && ./scanner_bench.out [megabytes]
+
+static std::string whitespace_heavy(size_t size, std::mt19937 &random) {
+  static const char spaces[] = { ' ', ' ', ' ', '\t', '\n', '\r' };
+  std::string input;
+  input.reserve(size + 64);
+  while (input.size() < size) {
+    size_t run = 16 + random() % 240;
+    for (size_t i = 0; i < run; ++i) input += spaces[random() % sizeof spaces];
+    input += "x";
+  }
+  return input;
+}
+
+static std::string identifier_heavy(size_t size, std::mt19937 &random) {
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+  std::string input;
+  input.reserve(size + 128);
+  while (input.size() < size) {
+    size_t length = 8 + random() % 56;
+    input += 'n';
+    for (size_t i = 1; i < length; ++i) input += letters[random() % (sizeof letters - 1)];
+    input += random() % 4 ? " " : " (\\";
+  }
+  return input;
+}
+
+static double measure(const std::string &input, size_t &tokens) {
+  auto start = std::chrono::steady_clock::now();
+  int repetitions = 0;
+  double seconds;
+  do {
+    tokens = Lexer::tokenize(input).size();
+    ++repetitions;
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (seconds < 0.5);
+  return input.size() * repetitions / seconds / (1024 * 1024);
+}
+
+int main(int argc, const char *argv[]) {
+  size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 64;
+  std::mt19937 random(42);
+
+  std::vector<std::pair<std::string, std::string>> inputs {
+    { "whitespace", whitespace_heavy(megabytes << 20, random) },
+    { "identifiers", identifier_heavy(megabytes << 20, random) },
+  };
+  const Scanner::Implementation implementations[] {
+    Scanner::Implementation::Scalar, Scanner::Implementation::SSE2, Scanner::Implementation::AVX2,
+  };
+
+  std::cout << std::left << std::setw(14) << "input" << std::setw(10) << "scanner"
+    << std::right << std::setw(12) << "MB/s" << std::setw(10) << "speedup" << "\n";
+
+  for (auto &[name, input] : inputs) {
+    double baseline = 0;
+    size_t expected = 0;
+    for (auto implementation : implementations) {
+      if (!Scanner::set_implementation(implementation)) continue;
+
+      size_t tokens;
+      double throughput = measure(input, tokens);
+      if (implementation == Scanner::Implementation::Scalar) {
+        baseline = throughput;
+        expected = tokens;
+      }
+      else if (tokens != expected) {
+        std::cout << "Token count mismatch for " << Scanner::get_implementation_string(implementation) << "\n";
+        return 1;
+      }
+
+      std::cout << std::left << std::setw(14) << name
+        << std::setw(10) << Scanner::get_implementation_string(implementation)
+        << std::right << std::fixed << std::setprecision(1) << std::setw(12) << throughput
+        << std::setw(9) << std::setprecision(2) << throughput / baseline << "x\n";
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <string>
+
+#include "TermGenerator.h"
+
+AST::Node *TermGenerator::generate(const Shape &shape, uint32_t seed, size_t &size) {
+  TermGenerator::shape = shape;
+  random.seed(seed);
+  built.clear();
+  generated = 0;
+
+  AST::Node *term = generate_term(shape.size, 0, shape.nesting);
+  built.clear();
+  size = generated;
+  return term;
+}
+
+AST::Node *TermGenerator::generate_term(size_t size, int binders, int nesting) {
+  if (size <= 1 or nesting <= 1) return generate_leaf(binders);
+
+  // Reused subterms keep their meaning only where the same binders are in
+  // scope, which any deeper place has as well
+  if (shape.sharing > 0 and !built.empty() and chance(shape.sharing)) {
+    const Built &pick = built[random() % built.size()];
+    if (pick.binders <= binders and pick.size <= size) {
+      generated += pick.size;
+      return pick.term->share();
+    }
+  }
+
+  size_t start = generated;
+  AST::Node *term;
+  if (size == 2 or chance(shape.binders)) {
+    term = generate_abstraction(size, binders, nesting);
+  }
+  else {
+    size_t left = 1 + random() % (size - 2);
+    AST::Node *function = left >= 2 and chance(shape.redexes)
+      ? generate_abstraction(left, binders, nesting - 1)
+      : generate_term(left, binders, nesting - 1);
+    AST::Node *argument = generate_term(size - 1 - left, binders, nesting - 1);
+    term = new AST::Application(function, argument, 0, 0);
+    ++generated;
+  }
+
+  built.push_back({ term, generated - start, binders });
+  return term;
+}
+
+AST::Node *TermGenerator::generate_leaf(int binders) {
+  // Outside every binder there is nothing to refer to but a free constant
+  ++generated;
+  if (binders == 0) return new AST::Constant(Symbols::intern("k"), 0, 0);
+  return new AST::Variable(1 + random() % binders, 0, 0);
+}
+
+AST::Node *TermGenerator::generate_abstraction(size_t size, int binders, int nesting) {
+  // Binders are named after their depth, so no name is ever shadowed
+  Symbols::Id name = Symbols::intern("x" + std::to_string(binders));
+  AST::Node *body = generate_term(size - 1, binders + 1, nesting - 1);
+  ++generated;
+  return new AST::Abstraction(name, body, 0, 0);
+}
+
+bool TermGenerator::chance(double probability) {
+  return std::uniform_real_distribution<double>(0, 1)(random) < probability;
+}
+
+thread_local TermGenerator::Shape TermGenerator::shape;
+thread_local std::mt19937 TermGenerator::random;
+thread_local std::vector<TermGenerator::Built> TermGenerator::built;
+thread_local size_t TermGenerator::generated;
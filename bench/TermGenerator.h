@@ -0,0 +1,54 @@
+#pragma once
+
+#include <random>
+#include <vector>
+#include <cstdint>
+
+#include "../src/AST.h"
+
+// Builds random well-scoped lambda terms straight as AST nodes, so that
+// benchmarks can scale terms without going through the parser
+class TermGenerator {
+public:
+  // size: number of nodes, counting a shared subterm once per use
+  // nesting: deepest chain of nodes; subterms that would nest deeper are
+  //   cut short into variables
+  // binders: chance that an inner node is an abstraction rather than an
+  //   application
+  // redexes: chance that an application's function is an abstraction
+  // sharing: chance that a subterm reuses one already built, when one fits
+  //   in its scope
+  class Shape {
+  public:
+    size_t size = 1000;
+    int nesting = 200;
+    double binders = 0.4;
+    double redexes = 0.1;
+    double sharing = 0;
+  };
+
+  // Also fills in the number of nodes the term has, unshared
+  static AST::Node *generate(const Shape &shape, uint32_t seed, size_t &size);
+
+private:
+  TermGenerator() = default;
+
+  // A subterm built so far, its number of nodes, and the number of binders
+  // it was built under, which any place reusing it needs as well
+  class Built {
+  public:
+    AST::Node *term;
+    size_t size;
+    int binders;
+  };
+
+  static AST::Node *generate_term(size_t size, int binders, int nesting);
+  static AST::Node *generate_leaf(int binders);
+  static AST::Node *generate_abstraction(size_t size, int binders, int nesting);
+  static bool chance(double probability);
+
+  static thread_local Shape shape;
+  static thread_local std::mt19937 random;
+  static thread_local std::vector<Built> built;
+  static thread_local size_t generated;
+};
@@ -1,6 +1,13 @@
 ﻿#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <unordered_set>
 
 #include "AST.h"
+#include "TermStore.h"
+#include "TypeChecker.h"
+#include "GraphReducer.h"
+#include "NodeHeap.h"
 
 #define C_LMB "\033[38;5;202m"
 #define C_ARG "\033[38;5;215m"
@@ -8,6 +15,7 @@
 
 #define C_VAR "\033[38;5;153m"
 #define C_CON "\033[38;5;133m"
+#define C_NUM "\033[38;5;222m"
 
 #define C_SYM "\033[38;5;231m"
 
@@ -20,11 +28,20 @@
 
 AST::Node::Node(Type type, size_t position, size_t length):
   type(type),
+  references(1),
+  free_bound(0),
+  normal(false),
+  published(false),
+  has_constants(false),
+  hash(0),
+  size(1),
   position(position),
   length(length) {
+  ++live_nodes;
 }
 
 AST::Node::~Node() {
+  --live_nodes;
 }
 
 AST::Node::Type AST::Node::get_type() const {
@@ -33,15 +50,55 @@ AST::Node::Type AST::Node::get_type() const {
 
 std::string AST::Node::get_type_string() const {
   static char const *const names[] {
-    "Variable", "Constant", "Abstraction", "Application", "Assignment",
+    "Variable", "Constant", "Abstraction", "Application", "Assignment", "Number", "Operator",
+    "Shift", "Substitution",
   };
   return std::string { names[static_cast<int>(type)] };
 }
 
+void *AST::Node::operator new(size_t size) {
+  return NodeHeap::allocate(size);
+}
+
+void AST::Node::operator delete(void *block, size_t size) {
+  NodeHeap::free(block, size);
+}
+
+AST::Node *AST::Node::share() {
+  if (published) __atomic_fetch_add(&references, 1, __ATOMIC_RELAXED);
+  else ++references;
+  return this;
+}
+
+void AST::Node::release() {
+  int remaining;
+  if (published) remaining = __atomic_sub_fetch(&references, 1, __ATOMIC_ACQ_REL);
+  else remaining = --references;
+  if (remaining > 0) return;
+
+  // Destructors release their children, which only queue them here, so
+  // freeing a deep term does not recurse once per level
+  garbage.push_back(this);
+  if (collecting) return;
+  collecting = true;
+  while (!garbage.empty()) {
+    Node *node = garbage.back();
+    garbage.pop_back();
+    delete node;
+  }
+  collecting = false;
+}
+
+AST::Node *AST::Node::view() {
+  return this;
+}
+
 AST::Variable::Variable(int bruijn_index, size_t position, size_t length):
   Node(Type::Variable, position, length),
   bruijn_index(bruijn_index) {
-  //
+  free_bound = bruijn_index;
+  normal.store(true, std::memory_order_relaxed);
+  hash = combine((uint64_t) type, bruijn_index);
 }
 
 AST::Variable::~Variable() {
@@ -50,7 +107,7 @@ AST::Variable::~Variable() {
 
 const std::string AST::Variable::to_string() {
   if (bruijn_index and bind_count - bruijn_index >= 0) {
-    std::string binding_name = bindings.at(bind_count - bruijn_index)->name;
+    const std::string &binding_name = Symbols::get_name(bindings.at(bind_count - bruijn_index)->name);
     return C_VAR + binding_name + C_RES;
   }
   else {
@@ -62,15 +119,12 @@ const std::string AST::Variable::to_simplified_string() {
   return std::to_string(bruijn_index);
 }
 
-AST::Node *AST::Variable::copy() {
-  return new Variable(bruijn_index, position, length);
-}
-
-void AST::Variable::offset_indexes(int offset, int current) {
+AST::Node *AST::Variable::offset_indexes(int offset, int current) {
   if (offset < 0 and bruijn_index + offset - current == 0)
     throw RuntimeException("Unreplaced variable had its bind deleted", position, length);
   if (bruijn_index > current)
-    bruijn_index += offset;
+    return new Variable(bruijn_index + offset, position, length);
+  return share();
 }
 
 std::set<int> AST::Variable::free_variables(int current_index) {
@@ -79,31 +133,26 @@ std::set<int> AST::Variable::free_variables(int current_index) {
   return std::set<int>();
 }
 
-AST::Node *AST::Variable::beta_reduce(Node *new_term, int current_index) {
-  //std::cout << "beta reduce on variable " << to_simplified_string() << ".\n";
-  if (bruijn_index == current_index) {
-    Node *copy = new_term->copy();
-    copy->offset_indexes(current_index);
-    delete this;
-    return copy;
-  }
-  return this;
-}
-
 AST::Node *AST::Variable::simplify() {
   //std::cout << "simplify variable " << to_simplified_string() << ".\n";
-  return this;
+  return share();
+}
+
+AST::Node *AST::Variable::normalize() {
+  return share();
 }
 
-void AST::Variable::update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) {
-  this->position = position;
-  this->length = length;
+AST::Node *AST::Variable::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  if (this->position == position and this->length == length) return share();
+  return new Variable(bruijn_index, position, length);
 }
 
-AST::Constant::Constant(std::string name, size_t position, size_t length):
+AST::Constant::Constant(Symbols::Id name, size_t position, size_t length):
   Node(Type::Constant, position, length),
   name(name) {
-  //
+  normal.store(true, std::memory_order_relaxed);
+  has_constants = true;
+  hash = combine((uint64_t) type, name);
 }
 
 AST::Constant::~Constant() {
@@ -111,38 +160,32 @@ AST::Constant::~Constant() {
 }
 
 const std::string AST::Constant::to_string() {
-  return C_CON + name + C_RES;
+  return C_CON + Symbols::get_name(name) + C_RES;
 }
 
 const std::string AST::Constant::to_simplified_string() {
-  return name;
-}
-
-AST::Node *AST::Constant::copy() {
-  return new Constant(name, position, length);
+  return Symbols::get_name(name);
 }
 
-void AST::Constant::offset_indexes(int offset, int current) {
-  //
+AST::Node *AST::Constant::offset_indexes(int offset, int current) {
+  return share();
 }
 
 std::set<int> AST::Constant::free_variables(int current_index) {
   return std::set<int>();
 }
 
-AST::Node *AST::Constant::beta_reduce(Node *new_term, int current_index) {
-  //std::cout << "beta reduce on constant " << to_simplified_string() << ".\n";
-  return this;
-}
-
 AST::Node *AST::Constant::simplify() {
   //std::cout << "simplify constant " << to_simplified_string() << ".\n";
-  return this;
+  return share();
+}
+
+AST::Node *AST::Constant::normalize() {
+  return share();
 }
 
-void AST::Constant::update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) {
-  this->position = position;
-  this->length = length;
+AST::Node *AST::Constant::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  Symbols::Id new_name = name;
 
   auto entry = binds.find(name);
   if (entry != binds.end()) {
@@ -158,233 +201,167 @@ void AST::Constant::update_name_shadowing(std::map<std::string, int> &binds, siz
     }
 
     //std::cout << "'" << name << "' changed to '" << name << "(" << count << ")'.\n";
-    name = name + "(" + std::to_string(count) + ")";
+    new_name = Symbols::rename(name, count);
   }
+
+  if (new_name == name and this->position == position and this->length == length) return share();
+  return new Constant(new_name, position, length);
 }
 
 AST::Node *AST::Constant::resolve() {
   Node *value = get_constant(name);
   if (value) {
     //std::cout << "Resolving constant " << name << "\n";
-    std::map<std::string, int> binds;
+    if (bindings.empty()) return value->share();
+
+    std::unordered_map<Symbols::Id, int> binds;
     for (size_t i = 0; i < bindings.size(); ++i) {
       //std::cout << "variable " << bindings.at(i)->name << " found\n";
       binds.insert_or_assign(bindings.at(i)->name, i);
     }
-    Node *resolved = value->copy();
-    resolved->update_name_shadowing(binds, position, length);
-    delete this;
-    return resolved;
+    return value->update_name_shadowing(binds, value->position, value->length);
   }
   else
-    return this;
+    return share();
 }
 
-AST::Abstraction::Abstraction(std::string name, Node *term, size_t position, size_t length, int previous_bind):
+AST::Abstraction::Abstraction(Symbols::Id name, Node *term, size_t position, size_t length, int previous_bind):
   Node(Type::Abstraction, position, length),
   name(name),
   term(term),
-  previous_bind(previous_bind) {
-  //
+  previous_bind(previous_bind),
+  uses(Usage::Unknown) {
+  free_bound = term->free_bound > 0 ? term->free_bound - 1 : 0;
+  has_constants = term->has_constants;
+  hash = combine((uint64_t) type, term->hash);
+  size = add_sizes(1, term->size);
 }
 
 AST::Abstraction::~Abstraction() {
-  delete term;
+  term->release();
 }
 
 const std::string AST::Abstraction::to_string() {
-  bindings.push_back(this);
-  ++bind_count;
-  std::string term_string = term->to_string();
-  --bind_count;
-  bindings.pop_back();
-  /*if (previous_bind > -1)
-    return C_LMB "\\*" C_ARG + name + C_DOT "." + term_string + C_RES;*/
-  return C_LMB "\\" C_ARG + name + C_DOT "." + term_string + C_RES;
+  return write(this);
 }
 
 const std::string AST::Abstraction::to_simplified_string() {
   return "L " + term->to_simplified_string();
 }
 
-AST::Node *AST::Abstraction::copy() {
-  return new Abstraction(name, term->copy(), position, length, previous_bind);
-}
-
-void AST::Abstraction::offset_indexes(int offset, int current) {
-  term->offset_indexes(offset, current + 1);
+AST::Node *AST::Abstraction::offset_indexes(int offset, int current) {
+  if (free_bound <= current) return share();
+  return new Abstraction(name, term->offset_indexes(offset, current + 1), position, length, previous_bind);
 }
 
 std::set<int> AST::Abstraction::free_variables(int current_index) {
+  if (free_bound <= current_index) return std::set<int>();
   return term->free_variables(current_index + 1);
 }
 
-AST::Node *AST::Abstraction::beta_reduce(Node *new_term, int current_index) {
-  //std::cout << "beta reduce on abstraction " << to_simplified_string() << ".\n";
-  if (previous_bind > -1) {
-    std::set<int> variables = new_term->free_variables();
-    //std::cout << "Free variables: ";
-    //for (auto &x : variables) {
-    //  std::cout << x << " ";
-    //}
-    //std::cout << "\n";
-    for (auto &x : variables) {
-      //std::cout << "var = " << x << "\n";
-      //std::cout << "var - current_index = " << (bind_count - current_index - x) << "\n";
-      //std::cout << name << " == " << bindings.at(bind_count - current_index - x)->name << "?\n";
-      if (bindings.at(bind_count - current_index - x)->name == name) {
-        int count = 1;
-
-        Abstraction *ptr = this;
-        while (ptr->previous_bind > -1) {
-          ptr = bindings.at(ptr->previous_bind);
-          ++count;
-        }
-
-        //std::cout << "'" << name << "' changed to '" << name << "(" << count << ")'.\n";
-        name = name + "(" + std::to_string(count) + ")";
-        break;
-      }
-    }
-  }
-
+AST::Node *AST::Abstraction::simplify() {
+  //std::cout << "simplify abstraction " << to_simplified_string() << ".\n";
+  if (normal) return share();
   bindings.push_back(this);
   ++bind_count;
 
-  term = term->beta_reduce(new_term, current_index + 1);
+  Node *body = term->view();
+  Node *result = body->simplify();
+  if (result != body) {
+    result = new Abstraction(name, result, position, length, previous_bind);
+  }
+  else {
+    result->release();
+    result = eta_reduce();
+    if (result == this and body->normal) normal.store(true, std::memory_order_relaxed);
+  }
 
   --bind_count;
   bindings.pop_back();
-  return this;
+  return result;
 }
 
-AST::Node *AST::Abstraction::simplify() {
-  //std::cout << "simplify abstraction " << to_simplified_string() << ".\n";
+AST::Node *AST::Abstraction::normalize() {
+  if (normal) return share();
+  check_stack(this);
   bindings.push_back(this);
   ++bind_count;
 
-  std::string before, after;
-  before = term->to_simplified_string();
-  term = term->simplify();
-  after = term->to_simplified_string();
-
-  --bind_count;
-  bindings.pop_back();
-
-  if (before != after) {
-    return this;
+  Node *body = term->view();
+  Node *new_body = body->normalize();
+  Abstraction *abstraction;
+  if (new_body == body) {
+    new_body->release();
+    abstraction = (Abstraction *) share();
   }
   else {
-    return eta_reduce();
-  }
-}
-
-void AST::Abstraction::update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) {
-  this->position = position;
-  this->length = length;
-
-  auto entry = binds.find(name);
-  if (entry == binds.end()) {
-    binds.insert({ name, bind_count });
-    ++bind_count;
-
-    term->update_name_shadowing(binds, position, length);
-
-    --bind_count;
-    binds.erase(name);
+    abstraction = new Abstraction(name, new_body, position, length, previous_bind);
   }
-  else {
-    int level = entry->second;
-    previous_bind = level;
-    //std::cout << "found previous at " << level << "\n";
 
-    entry->second = bind_count;
-    ++bind_count;
+  Node *result = abstraction->eta_reduce();
+  if (result == abstraction and abstraction->term->view()->normal) abstraction->normal.store(true, std::memory_order_relaxed);
+  abstraction->release();
 
-    term->update_name_shadowing(binds, position, length);
+  --bind_count;
+  bindings.pop_back();
+  return result;
+}
 
-    --bind_count;
-    entry->second = level;
-  }
+AST::Node *AST::Abstraction::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  return update_names(this, binds, position, length);
 }
 
 AST::Node *AST::Abstraction::eta_reduce() {
   //std::cout << "eta reduce on abstraction " << to_simplified_string() << ".\n";
-  //if (term->get_type() == Type::Application) {
-  //  std::cout << "is application.\n";
-  //  if (((Application *) term)->term2->get_type() == Type::Variable) {
-  //    std::cout << "has variable.\n";
-  //    std::cout << "bruijn index: " << ((Variable *) ((Application *) term)->term2)->bruijn_index << "\n";
-
-  //    std::cout << "Free variables: ";
-  //    for (auto &x : ((Application *) term)->term1->free_variables()) {
-  //      std::cout << x << " ";
-  //    }
-  //    std::cout << "\n";
-
-  //    std::cout << "variable count: " << ((Application *) term)->term1->free_variables().count(1) << "\n";
-  //  }
-  //  else {
-  //    std::cout << "has no variable.\n";
-  //  }
-  //}
-  //else {
-  //  std::cout << "is not application.\n";
-  //}
-
-  if (term->get_type() == Type::Application
-    and ((Application *) term)->term2->get_type() == Type::Variable
-    and ((Variable *) ((Application *) term)->term2)->bruijn_index == 1
-    and ((Application *) term)->term1->free_variables().count(1) == 0) {
-
-    Node *copy = ((Application *) term)->term1->copy();
-
-    copy->offset_indexes(-1);
-
-    delete this;
-    return copy;
+  Node *body = term->view();
+  if (body->get_type() != Type::Application) return share();
+
+  Node *function = ((Application *) body)->term1->view();
+  Node *argument = ((Application *) body)->term2->view();
+  if (argument->get_type() == Type::Variable
+    and ((Variable *) argument)->bruijn_index == 1
+    and function->free_variables().count(1) == 0) {
+
+    return function->offset_indexes(-1);
   }
   else {
-    return this;
+    return share();
   }
 }
 
+AST::Abstraction::Usage AST::Abstraction::usage() {
+  Usage usage = uses.load(std::memory_order_relaxed);
+  if (usage != Usage::Unknown) return usage;
+
+  // Every thread that asks at once counts the same, so the race is benign
+  static const Usage counts[] = { Usage::Zero, Usage::One, Usage::Many };
+  usage = counts[occurrences(term, 1)];
+  uses.store(usage, std::memory_order_relaxed);
+  return usage;
+}
+
 AST::Application::Application(Node *term1, Node *term2, size_t position, size_t length):
   Node(Type::Application, position, length),
   term1(term1),
   term2(term2) {
-  //
+  free_bound = std::max(term1->free_bound, term2->free_bound);
+  has_constants = term1->has_constants or term2->has_constants;
+  hash = combine(combine((uint64_t) type, term1->hash), term2->hash);
+  size = add_sizes(1, add_sizes(term1->size, term2->size));
 }
 
 AST::Application::~Application() {
-  delete term1;
-  delete term2;
+  term1->release();
+  term2->release();
 }
 
 const std::string AST::Application::to_string() {
-  std::string output = "";
-
-  if (term1->get_type() == Type::Abstraction) {
-    output += C_SYM "(" + term1->to_string() + C_SYM ") ";
-  }
-  else {
-    output += term1->to_string() + " ";
-  }
-
-  if (term2->get_type() == Type::Application) {
-    output += C_SYM "[" + term2->to_string() + C_SYM "]";
-  }
-  else if (term2->get_type() == Type::Abstraction) {
-    output += C_SYM "(" + term2->to_string() + C_SYM ")";
-  }
-  else {
-    output += term2->to_string();
-  }
-  return output;
+  return write(this);
 }
 
 const std::string AST::Application::to_simplified_string() {
   std::string output;
+  Node *term1 = this->term1->view(), *term2 = this->term2->view();
   if (term1->get_type() == Type::Abstraction) {
     output = "(" + term1->to_simplified_string() + ") ";
   }
@@ -404,17 +381,15 @@ const std::string AST::Application::to_simplified_string() {
   return output;
 }
 
-AST::Node *AST::Application::copy() {
-  return new Application(term1->copy(), term2->copy(), position, length);
-}
-
-void AST::Application::offset_indexes(int offset, int current) {
-  term1->offset_indexes(offset, current);
-  term2->offset_indexes(offset, current);
+AST::Node *AST::Application::offset_indexes(int offset, int current) {
+  if (free_bound <= current) return share();
+  Node *new_term1 = term1->offset_indexes(offset, current);
+  return new Application(new_term1, term2->offset_indexes(offset, current), position, length);
 }
 
 std::set<int> AST::Application::free_variables(int current_index) {
   std::set<int> result;
+  if (free_bound <= current_index) return result;
   for (auto &x : term1->free_variables(current_index)) {
     result.insert(x);
   }
@@ -424,213 +399,2181 @@ std::set<int> AST::Application::free_variables(int current_index) {
   return result;
 }
 
-AST::Node *AST::Application::beta_reduce(Node *new_term, int current_index) {
-  //std::cout << "beta reduce on application " << to_simplified_string() << ".\n";
-  term1 = term1->beta_reduce(new_term, current_index);
-  term2 = term2->beta_reduce(new_term, current_index);
-  return this;
-}
-
 AST::Node *AST::Application::simplify() {
   //std::cout << "simplify application " << to_simplified_string() << ".\n";
-  std::string before, after;
+  if (normal) return share();
+  Node *function = term1->view(), *argument = term2->view();
+  Node *result;
 
-  before = term1->to_simplified_string();
-  term1 = term1->simplify();
-  after = term1->to_simplified_string();
-  if (before != after) return this;
+  result = function->simplify();
+  if (result != function) return new Application(result, argument->share(), position, length);
+  result->release();
 
-  before = term2->to_simplified_string();
-  term2 = term2->simplify();
-  after = term2->to_simplified_string();
-  if (before != after) return this;
+  // An argument the body never uses is dropped without being reduced
+  if (function->get_type() == Type::Abstraction and ((Abstraction *) function)->usage() == Abstraction::Usage::Zero)
+    return shift(((Abstraction *) function)->term, -1);
 
-  if (term1->get_type() == Type::Abstraction) {
-    term1 = term1->beta_reduce(term2);
-    //std::cout << "Finished applying to " << to_simplified_string() << ".\n";
-    Abstraction *term1_abstraction = (Abstraction *) term1;
-    term1_abstraction->term->offset_indexes(-1);
-    Node *copy = term1_abstraction->term->copy();
-    //std::cout << "Finished copying " << copy->to_simplified_string() << ".\n";
-    delete this;
-    return copy;
+  result = argument->simplify();
+  if (result != argument) return new Application(function->share(), result, position, length);
+  result->release();
+
+  if (function->get_type() == Type::Abstraction) {
+    // The substitution is only carried out as far as later passes look
+    return substitute(((Abstraction *) function)->term, argument);
+  }
+  else if (function->get_type() == Type::Constant) {
+    result = ((Constant *) function)->resolve();
+    if (result != function) return new Application(result, argument->share(), position, length);
+    result->release();
+
+    // The constant may be defined by a later statement, so this is not marked
+    return share();
   }
-  else if (term1->get_type() == Type::Constant) {
-    term1 = ((Constant *) term1)->resolve();
-    return this;
+  else if (function->get_type() == Type::Number) {
+    return new Application(((Number *) function)->to_church(), argument->share(), position, length);
   }
+  else if (function->get_type() == Type::Application
+    and ((Application *) function)->term1->view()->get_type() == Type::Operator) {
+    Application *partial = (Application *) function;
+    Node *operation = partial->term1->view(), *operand = partial->term2->view();
+
+    for (Node *side : { operand, argument }) {
+      if (side->get_type() == Type::Constant and get_constant(((Constant *) side)->name)) {
+        Node *left = operand->get_type() == Type::Constant ? ((Constant *) operand)->resolve() : operand->share();
+        Node *right = side == argument ? ((Constant *) argument)->resolve() : argument->share();
+        Node *new_partial = new Application(operation->share(), left, partial->position, partial->length);
+        return new Application(new_partial, right, position, length);
+      }
+    }
 
-  return this;
+    long long left, right;
+    if (read_number(operand, left) and read_number(argument, right)) {
+      return ((Operator *) operation)->apply(left, right);
+    }
+    for (Node *side : { operand, argument }) {
+      if (side->get_type() == Type::Abstraction and !read_number(side, left))
+        throw RuntimeException("Expected a number", side->position, side->length);
+    }
+    if (operand->get_type() == Type::Constant or argument->get_type() == Type::Constant)
+      return share();
+  }
+
+  if (function->normal and argument->normal) normal.store(true, std::memory_order_relaxed);
+  return share();
+}
+
+AST::Node *AST::Application::normalize() {
+  if (normal) return share();
+  check_stack(this);
+
+  size_t base = states.size();
+  uint64_t previous_size = size;
+  int growth = 0;
+
+  // When contracting the head leaves another application, the same loop
+  // carries on with it instead of recursing once per step
+  Node *current = share();
+  Node *function = nullptr, *argument = nullptr, *next = nullptr;
+  try {
+    while (true) {
+      Application *application = (Application *) current;
+      if (strategy == Strategy::Normal) {
+        function = whnf(application->term1);
+        argument = application->term2->view()->share();
+      }
+      else {
+        function = application->term1->view()->normalize();
+        // Counting uses walks the body, so it is only worth it when an
+        // unused argument would otherwise still have to be reduced. The view
+        // is borrowed, so it only becomes argument, which the handler below
+        // releases, once it is a reference of its own
+        Node *view = application->term2->view();
+        bool dead = !view->normal and function->get_type() == Type::Abstraction
+          and ((Abstraction *) function)->usage() == Abstraction::Usage::Zero;
+        argument = dead ? view->share() : view->normalize();
+      }
+
+      next = contract(function, argument, application);
+      if (!next) {
+        if (strategy == Strategy::Normal) {
+          Node *normal_function = function->normalize();
+          function->release();
+          function = normal_function;
+          Node *normal_argument = argument->normalize();
+          argument->release();
+          argument = normal_argument;
+        }
+        Node *result = application->rebuild(function, argument);
+        current->release();
+        pop_states(base);
+        return result;
+      }
+
+      // States are only recorded once something is contracted, so terms that
+      // are already stuck cost nothing here
+      if (checked and states.size() == base) push_state(current, base);
+      function->release();
+      argument->release();
+      function = argument = nullptr;
+      current->release();
+      current = next->view()->share();
+      next->release();
+      next = nullptr;
+
+      if (current->get_type() != Type::Application) {
+        Node *result = current->normalize();
+        current->release();
+        pop_states(base);
+        return result;
+      }
+      if (checked) {
+        push_state(current, base);
+        check_growth(current, previous_size, growth);
+      }
+    }
+  }
+  catch (const RuntimeException &exception) {
+    for (Node *node : { current, function, argument, next }) {
+      if (node) node->release();
+    }
+    throw;
+  }
 }
 
-void AST::Application::update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) {
-  this->position = position;
-  this->length = length;
+AST::Node *AST::Application::rebuild(Node *function, Node *argument) {
+  Node *result;
+  if (function == term1->view() and argument == term2->view()) {
+    function->release();
+    argument->release();
+    result = share();
+  }
+  else {
+    result = new Application(function, argument, position, length);
+  }
+
+  // As in simplify, nothing whose progress hinges on a constant is marked
+  bool stuck = function->get_type() == Type::Constant;
+  if (function->get_type() == Type::Application
+    and ((Application *) function)->term1->view()->get_type() == Type::Operator) {
+    stuck = ((Application *) function)->term2->view()->get_type() == Type::Constant
+      or argument->get_type() == Type::Constant;
+  }
+  if (!stuck and function->normal and argument->normal) result->normal.store(true, std::memory_order_relaxed);
+  return result;
+}
 
-  term1->update_name_shadowing(binds, position, length);
-  term2->update_name_shadowing(binds, position, length);
+AST::Node *AST::Application::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  return update_names(this, binds, position, length);
 }
 
-AST::Assignment::Assignment(std::string name, Node *term, size_t position, size_t length):
+AST::Assignment::Assignment(Symbols::Id name, Node *term, size_t position, size_t length):
   Node(Type::Assignment, position, length),
   name(name),
   term(term) {
-  //
+  free_bound = term->free_bound;
+  has_constants = term->has_constants;
+  hash = combine(combine((uint64_t) type, name), term->hash);
+  size = add_sizes(1, term->size);
 }
 
 AST::Assignment::~Assignment() {
-  delete term;
+  term->release();
 }
 
 const std::string AST::Assignment::to_string() {
-  return C_ASG + name + C_SYM " = " + term->to_string() + C_RES;
+  return write(this);
 }
 
 const std::string AST::Assignment::to_simplified_string() {
-  return name + " = " + term->to_simplified_string();
+  return Symbols::get_name(name) + " = " + term->to_simplified_string();
 }
 
-AST::Node *AST::Assignment::copy() {
-  return new Assignment(name, term->copy(), position, length);
-}
-
-void AST::Assignment::offset_indexes(int offset, int current) {
+AST::Node *AST::Assignment::offset_indexes(int offset, int current) {
   throw RuntimeException("Invalid operation on assignment", position, length);
-  term->offset_indexes(offset, current);
 }
 
 std::set<int> AST::Assignment::free_variables(int current_index) {
   throw RuntimeException("Invalid operation on assignment", position, length);
-  return term->free_variables(current_index);
 }
 
-AST::Node *AST::Assignment::beta_reduce(Node *new_term, int current_index) {
-  throw RuntimeException("Invalid operation on assignment", position, length);
-  term = term->beta_reduce(new_term, current_index);
-  return this;
+AST::Node *AST::Assignment::simplify() {
+  Node *body = term->view();
+  Node *new_term = body->simplify();
+  if (new_term == body) {
+    new_term->release();
+    return share();
+  }
+  return new Assignment(name, new_term, position, length);
 }
 
-AST::Node *AST::Assignment::simplify() {
-  term = term->simplify();
-  return this;
+AST::Node *AST::Assignment::normalize() {
+  Node *body = term->view();
+  Node *new_term = body->normalize();
+  if (new_term == body) {
+    new_term->release();
+    return share();
+  }
+  return new Assignment(name, new_term, position, length);
 }
 
-void AST::Assignment::update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) {
+AST::Node *AST::Assignment::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
   throw RuntimeException("Invalid operation on assignment", position, length);
-  this->position = position;
-  this->length = length;
-  term->update_name_shadowing(binds, position, length);
 }
 
-std::string AST::to_string(Node *node) {
-  bindings = std::vector<Abstraction *>();
-  return node->to_string();
+AST::Number::Number(long long value, size_t position, size_t length):
+  Node(Type::Number, position, length),
+  value(value) {
+  normal.store(true, std::memory_order_relaxed);
+  hash = combine((uint64_t) type, value);
 }
 
+AST::Number::~Number() {
+  //
+}
 
-std::string AST::solve(Node *node, std::string expression) {
+const std::string AST::Number::to_string() {
+  return C_NUM + std::to_string(value) + C_RES;
+}
 
-  Node *current = node->copy();
-  std::string before, after;
+const std::string AST::Number::to_simplified_string() {
+  return "#" + std::to_string(value);
+}
 
-  try {
-    std::cout << "\n> " << to_string(current) << "\n";
+AST::Node *AST::Number::offset_indexes(int offset, int current) {
+  return share();
+}
 
-    for (int i = 0; i < 100; ++i) {
+std::set<int> AST::Number::free_variables(int current_index) {
+  return std::set<int>();
+}
 
-      before = current->to_simplified_string();
-      current = current->simplify();
-      after = current->to_simplified_string();
+AST::Node *AST::Number::simplify() {
+  return share();
+}
 
-      //std::cout << "From: " << before << "\n";
-      //std::cout << "To:   " << after << "\n";
+AST::Node *AST::Number::normalize() {
+  return share();
+}
 
-      if (before == after) goto success;
+AST::Node *AST::Number::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  if (this->position == position and this->length == length) return share();
+  return new Number(value, position, length);
+}
 
-      std::cout << "= " << to_string(current) << "\n";
-    }
-    //std::cout << current->get_type_string() << "\n";
-    throw RuntimeException("Infinite lambda expression", current->position, current->length);
-  success:;
-    //std::cout << "Finished!\n";
-  }
-  catch (const RuntimeException &exception) {
-    print_error(exception, expression);
-    delete current;
-    return "";
+AST::Node *AST::Number::to_church() {
+  if (value < 0)
+    throw RuntimeException("Negative number applied as a Church numeral", position, length);
+
+  Node *body = new Variable(1, position, length);
+  Node *function = new Variable(2, position, length);
+  for (long long i = 0; i < value; ++i) {
+    body = new Application(function->share(), body, position, length);
   }
+  function->release();
+  return new Abstraction(Symbols::intern("f"),
+    new Abstraction(Symbols::intern("x"), body, position, length), position, length);
+}
 
-  if (current->get_type() == Node::Type::Assignment) {
-    Assignment *assignment = (Assignment *) current;
-    Node *term = assignment->term->copy();
-    std::string assignment_name = assignment->name;
-    delete assignment;
-    if (term->get_type() == Node::Type::Constant
-      and ((Constant *) term)->name == assignment_name) {
-      remove_constant(assignment_name);
-      return C_ERR "Deleted constant " C_CON + assignment_name + C_RES;
-    }
-    else {
-      set_constant(assignment_name, term);
-      return C_SUC "Set constant " C_CON + assignment_name + C_SUC " to " + to_string(term) + C_RES;
-    }
+AST::Operator::Operator(char symbol, size_t position, size_t length):
+  Node(Type::Operator, position, length),
+  symbol(symbol) {
+  normal.store(true, std::memory_order_relaxed);
+  hash = combine((uint64_t) type, symbol);
+}
+
+AST::Operator::~Operator() {
+  //
+}
+
+const std::string AST::Operator::to_string() {
+  return C_SYM + std::string(1, symbol) + C_RES;
+}
+
+const std::string AST::Operator::to_simplified_string() {
+  return std::string(1, symbol);
+}
+
+AST::Node *AST::Operator::offset_indexes(int offset, int current) {
+  return share();
+}
+
+std::set<int> AST::Operator::free_variables(int current_index) {
+  return std::set<int>();
+}
+
+AST::Node *AST::Operator::simplify() {
+  return share();
+}
+
+AST::Node *AST::Operator::normalize() {
+  return share();
+}
+
+AST::Node *AST::Operator::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  if (this->position == position and this->length == length) return share();
+  return new Operator(symbol, position, length);
+}
+
+AST::Node *AST::Operator::apply(long long left, long long right) {
+  long long result;
+  const char *error = evaluate(symbol, left, right, result);
+  if (error)
+    throw RuntimeException(error, position, length);
+  return new Number(result, position, length);
+}
+
+const char *AST::Operator::evaluate(char symbol, long long left, long long right, long long &result) {
+  bool overflow = false;
+
+  switch (symbol) {
+  case '+':
+    overflow = __builtin_add_overflow(left, right, &result);
+    break;
+  case '-':
+    overflow = __builtin_sub_overflow(left, right, &result);
+    break;
+  case '*':
+    overflow = __builtin_mul_overflow(left, right, &result);
+    break;
+  case '/':
+    if (right == 0) return "Division by zero";
+    overflow = left == std::numeric_limits<long long>::min() and right == -1;
+    result = overflow ? 0 : left / right;
+    break;
+  default:
+    return "Unknown operator";
   }
-  else {
-    std::string result = to_string(current);
-    delete current;
-    return result;
+
+  return overflow ? "Integer overflow" : nullptr;
+}
+
+AST::Shift::Shift(Node *term, int offset, int cutoff):
+  Node(Type::Shift, term->position, term->length),
+  term(term),
+  offset(offset),
+  cutoff(cutoff),
+  expanded(nullptr) {
+  free_bound = term->free_bound > cutoff ? term->free_bound + offset : term->free_bound;
+  has_constants = term->has_constants;
+  hash = combine(combine(combine((uint64_t) type, term->hash), offset), cutoff);
+  size = term->size;
+}
+
+AST::Shift::~Shift() {
+  term->release();
+  if (expanded) expanded->release();
+}
+
+const std::string AST::Shift::to_string() {
+  return view()->to_string();
+}
+
+const std::string AST::Shift::to_simplified_string() {
+  return view()->to_simplified_string();
+}
+
+AST::Node *AST::Shift::offset_indexes(int offset, int current) {
+  if (expanded) return expanded->offset_indexes(offset, current);
+  return shift(this, offset, current);
+}
+
+std::set<int> AST::Shift::free_variables(int current_index) {
+  if (expanded) return expanded->free_variables(current_index);
+
+  std::set<int> result;
+  for (int variable : term->free_variables()) {
+    if (variable > cutoff) variable += offset;
+    if (variable > current_index) result.insert(variable - current_index);
   }
+  return result;
 }
 
-void AST::init() {
-  dictionary = std::map<std::string, Node *>();
+AST::Node *AST::Shift::simplify() {
+  return view()->simplify();
 }
 
-AST::Node *AST::get_constant(std::string name) {
-  auto entry = dictionary.find(name);
-  if (entry == dictionary.end()) {
-    return nullptr;
+AST::Node *AST::Shift::normalize() {
+  return view()->normalize();
+}
+
+AST::Node *AST::Shift::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  return view()->update_name_shadowing(binds, position, length);
+}
+
+AST::Node *AST::Shift::view() {
+  if (!expanded) {
+    Node *result = push();
+    expanded = result->view()->share();
+    result->release();
   }
-  else {
-    return entry->second;
+  return expanded;
+}
+
+AST::Node *AST::Shift::push() {
+  Node *inner = term->view();
+  if (inner->free_bound <= cutoff) return inner->share();
+
+  switch (inner->get_type()) {
+  case Type::Variable: {
+    int index = ((Variable *) inner)->bruijn_index;
+    if (index + offset <= cutoff)
+      throw RuntimeException("Unreplaced variable had its bind deleted", inner->position, inner->length);
+    return new Variable(index + offset, inner->position, inner->length);
+  }
+  case Type::Abstraction: {
+    Abstraction *abstraction = (Abstraction *) inner;
+    return new Abstraction(abstraction->name, shift(abstraction->term, offset, cutoff + 1),
+      abstraction->position, abstraction->length, abstraction->previous_bind);
+  }
+  case Type::Application: {
+    Application *application = (Application *) inner;
+    Node *term1 = shift(application->term1, offset, cutoff);
+    return new Application(term1, shift(application->term2, offset, cutoff), application->position, application->length);
+  }
+  default:
+    return inner->share();
   }
 }
 
-void AST::set_constant(std::string name, Node *value) {
-  dictionary.insert_or_assign(name, value);
+AST::Substitution::Substitution(Node *term, Node *argument, int depth):
+  Node(Type::Substitution, term->position, term->length),
+  term(term),
+  argument(argument),
+  depth(depth),
+  expanded(nullptr) {
+  free_bound = std::max(term->free_bound - 1, argument->free_bound ? argument->free_bound + depth - 1 : 0);
+  has_constants = term->has_constants or argument->has_constants;
+  hash = combine(combine(combine((uint64_t) type, term->hash), argument->hash), depth);
+  size = add_sizes(term->size, argument->size);
 }
 
-void AST::remove_constant(std::string name) {
-  dictionary.erase(name);
+AST::Substitution::~Substitution() {
+  term->release();
+  argument->release();
+  if (expanded) expanded->release();
 }
 
-void AST::end() {
-  for (auto &x : dictionary) {
-    delete x.second;
-  }
+const std::string AST::Substitution::to_string() {
+  return view()->to_string();
 }
 
-std::string AST::to_simplified_string(Node *node) {
-  return node->to_simplified_string();
+const std::string AST::Substitution::to_simplified_string() {
+  return view()->to_simplified_string();
+}
+
+AST::Node *AST::Substitution::offset_indexes(int offset, int current) {
+  if (expanded) return expanded->offset_indexes(offset, current);
+  return shift(this, offset, current);
 }
 
-std::vector<AST::Abstraction *> AST::bindings;
-int AST::bind_count;
+std::set<int> AST::Substitution::free_variables(int current_index) {
+  if (expanded) return expanded->free_variables(current_index);
 
-std::map<std::string, AST::Node *> AST::dictionary;
+  std::set<int> result;
+  for (int variable : term->free_variables()) {
+    if (variable == depth) {
+      for (int inner : argument->free_variables()) {
+        if (inner + depth - 1 > current_index) result.insert(inner + depth - 1 - current_index);
+      }
+      continue;
+    }
+    if (variable > depth) --variable;
+    if (variable > current_index) result.insert(variable - current_index);
+  }
+  return result;
+}
+
+AST::Node *AST::Substitution::simplify() {
+  return view()->simplify();
+}
+
+AST::Node *AST::Substitution::normalize() {
+  return view()->normalize();
+}
+
+AST::Node *AST::Substitution::update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  return view()->update_name_shadowing(binds, position, length);
+}
+
+AST::Node *AST::Substitution::view() {
+  if (!expanded) {
+    Node *result = push();
+    expanded = result->view()->share();
+    result->release();
+  }
+  return expanded;
+}
+
+AST::Node *AST::Substitution::push() {
+  Node *inner = term->view();
+  if (inner->free_bound < depth) return inner->share();
+
+  switch (inner->get_type()) {
+  case Type::Variable: {
+    int index = ((Variable *) inner)->bruijn_index;
+    if (index == depth) return shift(argument, depth - 1);
+    return new Variable(index - 1, inner->position, inner->length);
+  }
+  case Type::Abstraction: {
+    Abstraction *abstraction = (Abstraction *) inner;
+    Symbols::Id name = abstraction->name;
+
+    // Closures are pushed while the enclosing binders are on the stack, so
+    // the argument's free variables can be named from here
+    if (abstraction->previous_bind > -1) {
+      for (int variable : argument->free_variables()) {
+        int level = bind_count - (depth - 1) - variable;
+        if (level < 0 or level >= bind_count or bindings.at(level)->name != name) continue;
+
+        int count = 1;
+
+        Abstraction *ptr = abstraction;
+        while (ptr->previous_bind > -1 and ptr->previous_bind < bind_count) {
+          ptr = bindings.at(ptr->previous_bind);
+          ++count;
+        }
+
+        //std::cout << "'" << name << "' changed to '" << name << "(" << count << ")'.\n";
+        name = Symbols::rename(abstraction->name, count);
+        break;
+      }
+    }
+
+    return new Abstraction(name, substitute(abstraction->term, argument, depth + 1),
+      abstraction->position, abstraction->length, abstraction->previous_bind);
+  }
+  case Type::Application: {
+    Application *application = (Application *) inner;
+    Node *term1 = substitute(application->term1, argument, depth);
+    return new Application(term1, substitute(application->term2, argument, depth), application->position, application->length);
+  }
+  default:
+    return inner->share();
+  }
+}
+
+AST::Node *AST::whnf(Node *node) {
+  check_stack(node);
+  Node *current = node->view()->share();
+  size_t base = states.size();
+  uint64_t previous_size = current->size;
+  int growth = 0;
+
+  Node *function = nullptr, *next = nullptr;
+  try {
+    while (current->get_type() == Node::Type::Application) {
+      Application *application = (Application *) current;
+      function = whnf(application->term1);
+      next = contract(function, application->term2->view(), application);
+
+      if (!next) {
+        pop_states(base);
+        if (function == application->term1->view()) {
+          function->release();
+          return current;
+        }
+        Node *stuck = new Application(function, application->term2->share(), application->position, application->length);
+        current->release();
+        return stuck;
+      }
+
+      if (checked and states.size() == base) push_state(current, base);
+      function->release();
+      function = nullptr;
+      current->release();
+      current = next->view()->share();
+      next->release();
+      next = nullptr;
+
+      if (checked and current->get_type() == Node::Type::Application) {
+        push_state(current, base);
+        check_growth(current, previous_size, growth);
+      }
+    }
+  }
+  catch (const RuntimeException &exception) {
+    for (Node *node : { current, function, next }) {
+      if (node) node->release();
+    }
+    throw;
+  }
+  pop_states(base);
+  return current;
+}
+
+AST::Node *AST::contract(Node *function, Node *argument, Node *redex) {
+  switch (function->get_type()) {
+  case Node::Type::Abstraction:
+    count_step(redex);
+    // Nothing is left holding an argument that the body is known not to use
+    if (((Abstraction *) function)->uses.load(std::memory_order_relaxed) == Abstraction::Usage::Zero)
+      return shift(((Abstraction *) function)->term, -1);
+    return substitute(((Abstraction *) function)->term, argument);
+  case Node::Type::Constant: {
+    Node *value = ((Constant *) function)->resolve();
+    if (value == function) {
+      value->release();
+      return nullptr;
+    }
+    count_step(redex);
+    return new Application(value, argument->share(), redex->position, redex->length);
+  }
+  case Node::Type::Number:
+    count_step(redex);
+    return new Application(((Number *) function)->to_church(), argument->share(), redex->position, redex->length);
+  case Node::Type::Application:
+    break;
+  default:
+    return nullptr;
+  }
+
+  Application *partial = (Application *) function;
+  Node *operation = partial->term1->view();
+  if (operation->get_type() != Node::Type::Operator) return nullptr;
+
+  // Operands are reduced to numbers first whatever the strategy
+  Node *operands[2] = { partial->term2->view(), argument };
+  Node *values[2];
+  for (int i = 0; i < 2; ++i) {
+    Node *value = operands[i]->get_type() == Node::Type::Constant ? ((Constant *) operands[i])->resolve() : operands[i]->share();
+    values[i] = value->view()->normalize();
+    value->release();
+  }
+
+  Node *result = nullptr;
+  long long left, right;
+  if (read_number(values[0], left) and read_number(values[1], right)) {
+    count_step(redex);
+    result = ((Operator *) operation)->apply(left, right);
+  }
+  else {
+    for (Node *value : values) {
+      if (value->get_type() == Node::Type::Abstraction and !read_number(value, left)) {
+        RuntimeException exception("Expected a number", value->position, value->length);
+        values[0]->release();
+        values[1]->release();
+        throw exception;
+      }
+    }
+    if (values[0] != operands[0] or values[1] != operands[1]) {
+      Node *new_partial = new Application(operation->share(), values[0]->share(), partial->position, partial->length);
+      result = new Application(new_partial, values[1]->share(), redex->position, redex->length);
+    }
+  }
+
+  values[0]->release();
+  values[1]->release();
+  return result;
+}
+
+void AST::count_step(Node *redex) {
+  if (++steps > max_steps and checked)
+    throw RuntimeException("Infinite lambda expression", redex->position, redex->length);
+  if (steps % 256 != 0) return;
+  if (const char *message = checkpoint(steps))
+    throw RuntimeException(message, redex->position, redex->length);
+}
+
+uint64_t AST::combine(uint64_t seed, uint64_t value) {
+  // splitmix64 finaliser over the seed and the new value
+  uint64_t x = seed * 0x9e3779b97f4a7c15ULL + value;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+uint64_t AST::add_sizes(uint64_t left, uint64_t right) {
+  uint64_t sum;
+  if (__builtin_add_overflow(left, right, &sum)) return UINT64_MAX;
+  return sum;
+}
+
+void AST::push_state(Node *state, size_t base) {
+  // Evaluation is deterministic, so meeting a term again while it is still
+  // being reduced means the reduction can never finish. Hashes only pick
+  // the candidates; alpha-equivalence decides
+  if (state_hashes.count(state->hash)) {
+    for (size_t i = states.size(); i-- > 0;) {
+      if (states[i]->hash != state->hash or !equals(states[i], state)) continue;
+
+      if (i >= base) {
+        size_t period = states.size() - i;
+        throw RuntimeException("Infinite lambda expression, reduces back to itself after "
+          + std::to_string(period) + (period == 1 ? " step" : " steps"), state->position, state->length);
+      }
+      throw RuntimeException("Infinite lambda expression, needs its own normal form", state->position, state->length);
+    }
+  }
+
+  states.push_back(state->share());
+  ++state_hashes[state->hash];
+
+  if (states.size() - base > state_window) {
+    Node *oldest = states[base];
+    if (--state_hashes[oldest->hash] == 0) state_hashes.erase(oldest->hash);
+    oldest->release();
+    states.erase(states.begin() + base);
+  }
+}
+
+void AST::pop_states(size_t base) {
+  while (states.size() > base) {
+    Node *state = states.back();
+    if (--state_hashes[state->hash] == 0) state_hashes.erase(state->hash);
+    state->release();
+    states.pop_back();
+  }
+}
+
+void AST::check_growth(Node *state, uint64_t &previous_size, int &growth) {
+  if (state->size > previous_size) {
+    if (++growth >= growth_window and state->size >= max_size)
+      throw RuntimeException("Infinite lambda expression, probably diverges as it keeps growing", state->position, state->length);
+  }
+  else {
+    growth = 0;
+  }
+  previous_size = state->size;
+}
+
+void AST::check_stack(Node *node) {
+  // Terms that keep growing to the left nest one call per step, so they are
+  // stopped before they run out of stack
+  char marker;
+  if ((size_t) (stack_base - &marker) > stack_limit)
+    throw RuntimeException("Reduction too deep", node->position, node->length);
+}
+
+AST::Namespace::~Namespace() {
+  for (auto [name, value] : overlay) {
+    if (value) value->release();
+  }
+}
+
+std::string AST::to_string(Node *node) {
+  bindings = std::vector<Abstraction *>();
+  return node->to_string();
+}
+
+
+std::string AST::solve(Node *node, std::string_view expression) {
+  // What the statements before this one left behind on this thread is
+  // dead by now, so this is where the node heap collects
+  NodeHeap::collect();
+
+  bindings.clear();
+  bind_count = 0;
+  deadline = std::chrono::steady_clock::now() + time_limit;
+  Node *current = node->share();
+  std::string type;
+  bool typed = false;
+
+  char marker;
+  stack_base = &marker;
+
+  try {
+    if (verbose) *output << "\n> " << to_string(current) << "\n";
+    if (infer_types) typed = TypeChecker::infer(current, type);
+
+    if (engine == Engine::Compact or engine == Engine::Graph) {
+      auto normalize = engine == Engine::Compact ? TermStore::normalize : GraphReducer::normalize;
+      Node *normal;
+      if (current->get_type() == Node::Type::Assignment) {
+        Assignment *assignment = (Assignment *) current;
+        normal = new Assignment(assignment->name, normalize(assignment->term), assignment->position, assignment->length);
+      }
+      else {
+        normal = normalize(current);
+      }
+      current->release();
+      current = normal;
+      goto success;
+    }
+
+    // Without steps to print, the whole term is reduced in one traversal
+    if (!verbose or !show_steps or strategy == Strategy::Normal) {
+      steps = 0;
+      // Simply typed terms are known to terminate, so they are reduced
+      // without looking for cycles or counting steps against the limit
+      checked = !typed;
+      Node *normal = current->normalize();
+      checked = true;
+      current->release();
+      current = expand(normal);
+      normal->release();
+      goto success;
+    }
+
+    push_state(current, 0);
+    for (int i = 0; i < 100; ++i) {
+      // Every pass prints a line already, so only cancellation is checked
+      if (cancelled())
+        throw RuntimeException("Evaluation interrupted", current->position, current->length);
+
+      Node *next = current->simplify();
+
+      // Unchanged subterms are shared, so a pass that reduced nothing hands
+      // back the very same node. A pass that did reduce something but gives
+      // back an earlier term is caught as a cycle
+      if (next == current->view()) {
+        next->release();
+        next = expand(current);
+        current->release();
+        current = next;
+        pop_states(0);
+        goto success;
+      }
+      current->release();
+      current = next;
+
+      if (verbose) *output << "= " << to_string(current) << "\n";
+      push_state(current, 0);
+    }
+    //std::cout << current->get_type_string() << "\n";
+    throw RuntimeException("Infinite lambda expression", current->position, current->length);
+  success:;
+    //std::cout << "Finished!\n";
+  }
+  catch (const RuntimeException &exception) {
+    checked = true;
+    print_error(exception, expression);
+    current->release();
+    pop_states(0);
+    return "";
+  }
+
+  if (typed) type = C_SYM " : " C_ARG + type + C_RES;
+
+  if (current->get_type() == Node::Type::Assignment) {
+    Assignment *assignment = (Assignment *) current;
+    Node *term = assignment->term->share();
+    Symbols::Id assignment_name = assignment->name;
+    assignment->release();
+    if (term->get_type() == Node::Type::Constant
+      and ((Constant *) term)->name == assignment_name) {
+      term->release();
+      remove_constant(assignment_name);
+      if (!verbose) return "";
+      return C_ERR "Deleted constant " C_CON + Symbols::get_name(assignment_name) + C_RES;
+    }
+    else {
+      set_constant(assignment_name, term);
+      if (!verbose) return "";
+      return C_SUC "Set constant " C_CON + Symbols::get_name(assignment_name) + C_SUC " to " + to_result_string(get_constant(assignment_name)) + type + C_RES;
+    }
+  }
+  else {
+    Symbols::Id name;
+    if (find_constant(current, name)) {
+      current->release();
+      return C_CON + Symbols::get_name(name) + C_RES + type;
+    }
+    std::string result = read_back(current);
+    if (result == "")
+      result = to_result_string(current);
+    else
+      result += " (church)";
+    current->release();
+    return result + type;
+  }
+}
+
+void AST::set_verbose(bool verbose) {
+  AST::verbose = verbose;
+}
+
+void AST::set_engine(Engine engine) {
+  AST::engine = engine;
+}
+
+void AST::set_strategy(Strategy strategy) {
+  AST::strategy = strategy;
+}
+
+void AST::set_printing(Printing printing) {
+  AST::printing = printing;
+}
+
+void AST::set_show_steps(bool show_steps) {
+  AST::show_steps = show_steps;
+}
+
+void AST::set_infer_types(bool infer_types) {
+  AST::infer_types = infer_types;
+}
+
+void AST::set_time_limit(std::chrono::milliseconds time_limit) {
+  AST::time_limit = time_limit;
+}
+
+void AST::set_control(Control *control) {
+  AST::control = control;
+}
+
+bool AST::cancelled() {
+  return control and control->cancelled.load(std::memory_order_relaxed);
+}
+
+const char *AST::checkpoint(size_t steps) {
+  if (cancelled()) return "Evaluation interrupted";
+  if (timed_out()) return "Evaluation timed out";
+
+  if (control and control->report) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= control->next_report) {
+      control->steps = steps;
+      control->nodes = live_nodes;
+      control->report(*control);
+      control->next_report = now + control->interval;
+    }
+  }
+  return nullptr;
+}
+
+bool AST::timed_out() {
+  return time_limit.count() > 0 and std::chrono::steady_clock::now() > deadline;
+}
+
+void AST::set_output(std::ostream &output) {
+  AST::output = &output;
+}
+
+std::ostream &AST::get_output() {
+  return *output;
+}
+
+void AST::init() {
+  dictionary = std::vector<Node *>();
+}
+
+void AST::set_namespace(Namespace *names) {
+  AST::names = names;
+}
+
+AST::Node *AST::get_constant(Symbols::Id name) {
+  if (names and !names->overlay.empty()) {
+    auto entry = names->overlay.find(name);
+    if (entry != names->overlay.end()) return entry->second;
+  }
+
+  if (name >= dictionary.size()) {
+    return nullptr;
+  }
+  else {
+    return dictionary[name];
+  }
+}
+
+void AST::set_constant(Symbols::Id name, Node *value) {
+  // Definitions are shared into every term that uses them, so their own
+  // source positions are dropped
+  // They are also built in the old generation, as they outlive the
+  // statement that set them
+  std::unordered_map<Symbols::Id, int> binds;
+  Node *definition;
+  {
+    NodeHeap::Tenured tenured;
+    definition = value->update_name_shadowing(binds, std::string_view::npos, 0);
+  }
+  value->release();
+
+  // The graph engine compiles every definition once, as it is set
+  if (engine == Engine::Graph) GraphReducer::define(name, definition);
+
+  // A session's definitions are only reached from that session, so they
+  // are not published
+  if (names) {
+    Node *&entry = names->overlay[name];
+    if (entry) {
+      unindex_constant(name, entry);
+      entry->release();
+    }
+    entry = definition;
+    index_constant(name, definition);
+    track(name, definition);
+    return;
+  }
+
+  if (name >= dictionary.size()) reserve_constants();
+  if (dictionary[name]) {
+    unindex_constant(name, dictionary[name]);
+    dictionary[name]->release();
+  }
+  dictionary[name] = definition;
+  index_constant(name, definition);
+  track(name, definition);
+  publish(definition);
+}
+
+void AST::remove_constant(Symbols::Id name) {
+  bool shared = name < dictionary.size() and dictionary[name];
+
+  if (names) {
+    auto entry = names->overlay.find(name);
+    if (entry != names->overlay.end() and entry->second) {
+      unindex_constant(name, entry->second);
+      entry->second->release();
+    }
+    if (shared) names->overlay[name] = nullptr;
+    else if (entry != names->overlay.end()) names->overlay.erase(entry);
+    track(name, nullptr);
+    return;
+  }
+
+  if (!shared) return;
+  unindex_constant(name, dictionary[name]);
+  dictionary[name]->release();
+  dictionary[name] = nullptr;
+  track(name, nullptr);
+}
+
+size_t AST::count_constants() {
+  size_t count = 0;
+  for (Node *value : dictionary) {
+    if (value) ++count;
+  }
+  if (!names) return count;
+
+  for (auto [name, value] : names->overlay) {
+    bool shared = name < dictionary.size() and dictionary[name];
+    if (value and !shared) ++count;
+    if (!value and shared) --count;
+  }
+  return count;
+}
+
+void AST::reserve_constants() {
+  if (dictionary.size() < Symbols::size()) dictionary.resize(Symbols::size(), nullptr);
+  if (revisions.size() < Symbols::size()) revisions.resize(Symbols::size(), 0);
+  if (dependencies.size() < Symbols::size()) dependencies.resize(Symbols::size());
+}
+
+uint64_t AST::reserve_order(size_t count) {
+  return last_order.fetch_add(count) + 1;
+}
+
+void AST::set_order(uint64_t order) {
+  AST::order = order;
+}
+
+std::vector<Symbols::Id> AST::references(Node *node) {
+  // Normal forms share subterms, which are walked once
+  std::vector<Symbols::Id> names;
+  std::unordered_set<Symbols::Id> seen;
+  std::unordered_set<Node *> visited;
+  std::vector<Node *> pending { node };
+  while (!pending.empty()) {
+    node = pending.back()->view();
+    pending.pop_back();
+    if (!node->has_constants or !visited.insert(node).second) continue;
+
+    switch (node->type) {
+    case Node::Type::Constant:
+      if (seen.insert(((Constant *) node)->name).second) names.push_back(((Constant *) node)->name);
+      break;
+    case Node::Type::Abstraction:
+      pending.push_back(((Abstraction *) node)->term);
+      break;
+    case Node::Type::Application:
+      pending.push_back(((Application *) node)->term2);
+      pending.push_back(((Application *) node)->term1);
+      break;
+    case Node::Type::Assignment:
+      pending.push_back(((Assignment *) node)->term);
+      break;
+    default:
+      break;
+    }
+  }
+  return names;
+}
+
+bool AST::defines(Node *node, Symbols::Id &name, bool &deletes) {
+  if (node->type != Node::Type::Assignment) return false;
+  Assignment *assignment = (Assignment *) node;
+  Node *term = assignment->term->view();
+  name = assignment->name;
+  deletes = term->type == Node::Type::Constant and ((Constant *) term)->name == name;
+  return true;
+}
+
+uint64_t AST::revision(Symbols::Id name) {
+  if (names and !names->revisions.empty()) {
+    auto entry = names->revisions.find(name);
+    if (entry != names->revisions.end()) return entry->second;
+  }
+  return name < revisions.size() ? revisions[name] : 0;
+}
+
+bool AST::is_referenced(Symbols::Id name) {
+  if (name < dependencies.size() and !dependencies[name].users.empty()) return true;
+  if (!names) return false;
+  auto entry = names->dependencies.find(name);
+  return entry != names->dependencies.end() and !entry->second.users.empty();
+}
+
+long AST::count_nodes() {
+  return live_nodes;
+}
+
+void AST::end() {
+  TypeChecker::clear();
+  GraphReducer::clear();
+  for (Node *value : dictionary) {
+    if (value) value->release();
+  }
+  dictionary.clear();
+  normal_forms.clear();
+  dependencies.clear();
+  revisions.clear();
+}
+
+std::string AST::to_simplified_string(Node *node) {
+  return node->to_simplified_string();
+}
+
+void AST::publish(Node *node) {
+  // A definition is set before any other thread can reach it: either no
+  // evaluation runs, or, while a file is loaded in parallel, only those that
+  // do not depend on it. So the flags are in place before it is shared
+  std::vector<Node *> pending { node };
+  while (!pending.empty()) {
+    node = pending.back();
+    pending.pop_back();
+    if (!node or node->published) continue;
+    node->published = true;
+
+    switch (node->type) {
+    case Node::Type::Abstraction:
+      pending.push_back(((Abstraction *) node)->term);
+      break;
+    case Node::Type::Application:
+      pending.push_back(((Application *) node)->term1);
+      pending.push_back(((Application *) node)->term2);
+      break;
+    case Node::Type::Assignment:
+      pending.push_back(((Assignment *) node)->term);
+      break;
+    case Node::Type::Shift:
+      pending.push_back(((Shift *) node)->term);
+      pending.push_back(((Shift *) node)->expanded);
+      break;
+    case Node::Type::Substitution:
+      pending.push_back(((Substitution *) node)->term);
+      pending.push_back(((Substitution *) node)->argument);
+      pending.push_back(((Substitution *) node)->expanded);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool AST::equals(Node *left, Node *right) {
+  // Binders are kept on the stack so that closures met on the way are pushed
+  // in their own scope
+  int depth = 0;
+  bool equal;
+
+  while (true) {
+    left = left->view();
+    right = right->view();
+    if (left == right) {
+      equal = true;
+      break;
+    }
+    if (left->type != right->type) {
+      equal = false;
+      break;
+    }
+
+    if (left->type == Node::Type::Abstraction) {
+      bindings.push_back((Abstraction *) left);
+      ++bind_count;
+      ++depth;
+      left = ((Abstraction *) left)->term;
+      right = ((Abstraction *) right)->term;
+    }
+    else if (left->type == Node::Type::Application) {
+      if (!equals(((Application *) left)->term1, ((Application *) right)->term1)) {
+        equal = false;
+        break;
+      }
+      left = ((Application *) left)->term2;
+      right = ((Application *) right)->term2;
+    }
+    else if (left->type == Node::Type::Assignment) {
+      if (((Assignment *) left)->name != ((Assignment *) right)->name) {
+        equal = false;
+        break;
+      }
+      left = ((Assignment *) left)->term;
+      right = ((Assignment *) right)->term;
+    }
+    else {
+      switch (left->type) {
+      case Node::Type::Variable:
+        equal = ((Variable *) left)->bruijn_index == ((Variable *) right)->bruijn_index;
+        break;
+      case Node::Type::Constant:
+        equal = ((Constant *) left)->name == ((Constant *) right)->name;
+        break;
+      case Node::Type::Number:
+        equal = ((Number *) left)->value == ((Number *) right)->value;
+        break;
+      case Node::Type::Operator:
+        equal = ((Operator *) left)->symbol == ((Operator *) right)->symbol;
+        break;
+      default:
+        equal = false;
+      }
+      break;
+    }
+  }
+
+  bind_count -= depth;
+  bindings.resize(bindings.size() - depth);
+  return equal;
+}
+
+uint64_t AST::hash_term(Node *node) {
+  // Closures hash apart from the terms they stand for, so the hash is taken
+  // again over what they show. Results can nest as deep as any numeral, so
+  // the walk keeps its pending nodes on a stack; a node is met once before
+  // its parts and once after them
+  std::vector<std::pair<Node *, bool>> pending { { node, false } };
+  std::vector<uint64_t> hashes;
+
+  while (!pending.empty()) {
+    auto [next, after] = pending.back();
+    pending.pop_back();
+    next = next->view();
+
+    if (next->type == Node::Type::Abstraction) {
+      if (after) {
+        hashes.back() = combine((uint64_t) next->type, hashes.back());
+        continue;
+      }
+      pending.push_back({ next, true });
+      pending.push_back({ ((Abstraction *) next)->term, false });
+    }
+    else if (next->type == Node::Type::Application) {
+      if (after) {
+        uint64_t argument = hashes.back();
+        hashes.pop_back();
+        hashes.back() = combine(combine((uint64_t) next->type, hashes.back()), argument);
+        continue;
+      }
+      pending.push_back({ next, true });
+      pending.push_back({ ((Application *) next)->term2, false });
+      pending.push_back({ ((Application *) next)->term1, false });
+    }
+    else {
+      hashes.push_back(next->hash);
+    }
+  }
+  return hashes.back();
+}
+
+void AST::index_constant(Symbols::Id name, Node *value) {
+  // Only functions are named in results; anything else already prints as
+  // short as its name. Definitions hold no closures, so their own hash is
+  // the one results are looked up by
+  if (value->type != Node::Type::Abstraction) return;
+  // Files are loaded by several threads, each setting its own constants
+  std::unique_lock<std::mutex> guard(indexing, std::defer_lock);
+  if (!names) guard.lock();
+  auto &table = names ? names->normal_forms : normal_forms;
+  std::pair<uint64_t, Symbols::Id> entry { order ? order : ++last_order, name };
+  auto &candidates = table[value->hash];
+  candidates.insert(std::upper_bound(candidates.begin(), candidates.end(), entry), entry);
+}
+
+void AST::unindex_constant(Symbols::Id name, Node *value) {
+  if (value->type != Node::Type::Abstraction) return;
+  std::unique_lock<std::mutex> guard(indexing, std::defer_lock);
+  if (!names) guard.lock();
+  auto &table = names ? names->normal_forms : normal_forms;
+  auto entry = table.find(value->hash);
+  if (entry == table.end()) return;
+
+  std::vector<std::pair<uint64_t, Symbols::Id>> &candidates = entry->second;
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    if (candidates[i].second != name) continue;
+    candidates.erase(candidates.begin() + i);
+    break;
+  }
+  if (candidates.empty()) table.erase(entry);
+}
+
+void AST::track(Symbols::Id name, Node *value) {
+  // Definitions keep by name the constants that did not have to be unfolded
+  // to reach their normal form, so they change meaning with them
+  std::unique_lock<std::mutex> guard(indexing, std::defer_lock);
+  if (!names) guard.lock();
+  auto at = [&](Symbols::Id id) -> Dependencies & {
+    if (names) return names->dependencies[id];
+    if (id >= dependencies.size()) dependencies.resize(Symbols::size());
+    return dependencies[id];
+  };
+
+  std::vector<Symbols::Id> previous = std::move(at(name).uses);
+  for (Symbols::Id used : previous) {
+    std::vector<Symbols::Id> &users = at(used).users;
+    users.erase(std::find(users.begin(), users.end(), name));
+  }
+  std::vector<Symbols::Id> uses;
+  if (value and value->has_constants) {
+    for (Symbols::Id used : references(value)) {
+      if (used == name) continue;
+      at(used).users.push_back(name);
+      uses.push_back(used);
+    }
+  }
+  at(name).uses = std::move(uses);
+
+  // Everything that refers to the constant, directly or not, is only given
+  // a new revision; whatever was derived from it is worked out again the
+  // next time it is needed
+  uint64_t revision = ++last_revision;
+  auto stamp = [&](Symbols::Id id) {
+    if (names) names->revisions[id] = revision;
+    else revisions[id] = revision;
+  };
+  stamp(name);
+  if (!is_referenced(name)) return;
+
+  std::vector<Symbols::Id> pending { name };
+  std::unordered_set<Symbols::Id> seen { name };
+  auto reach = [&](const std::vector<Symbols::Id> &users) {
+    for (Symbols::Id user : users) {
+      if (seen.insert(user).second) pending.push_back(user);
+    }
+  };
+  while (!pending.empty()) {
+    Symbols::Id next = pending.back();
+    pending.pop_back();
+    if (next != name) stamp(next);
+
+    if (next < dependencies.size()) reach(dependencies[next].users);
+    if (!names) continue;
+    auto entry = names->dependencies.find(next);
+    if (entry != names->dependencies.end()) reach(entry->second.users);
+  }
+}
+
+bool AST::find_constant(Node *node, Symbols::Id &name) {
+  // The session's own constants come first, then those defined earlier.
+  // Every candidate is checked
+  // against the definition it has now, which rules out hash collisions and
+  // constants of the dictionary that the session hid or redefined
+  if (node->view()->type != Node::Type::Abstraction) return false;
+  uint64_t hash = hash_term(node);
+
+  for (auto *table : { names ? &names->normal_forms : nullptr, &normal_forms }) {
+    if (!table) continue;
+    auto entry = table->find(hash);
+    if (entry == table->end()) continue;
+    for (auto [defined, candidate] : entry->second) {
+      Node *value = get_constant(candidate);
+      if (!value or !equals(value, node)) continue;
+      name = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+AST::Node *AST::shift(Node *term, int offset, int cutoff) {
+  if (offset == 0 or term->free_bound <= cutoff) return term->share();
+  return new Shift(term->share(), offset, cutoff);
+}
+
+AST::Node *AST::substitute(Node *term, Node *argument, int depth) {
+  if (term->free_bound < depth) return term->share();
+
+  // Variables are replaced straight away, a closure would cost as much
+  if (term->get_type() == Node::Type::Variable) {
+    int index = ((Variable *) term)->bruijn_index;
+    if (index == depth) return shift(argument, depth - 1);
+    return new Variable(index - 1, term->position, term->length);
+  }
+  return new Substitution(term->share(), argument->share(), depth);
+}
+
+int AST::occurrences(Node *term, int index) {
+  // Counts up to two, which is all a binder needs to know. Closures are
+  // looked through without being pushed
+  if (term->free_bound < index) return 0;
+  check_stack(term);
+
+  switch (term->type) {
+  case Node::Type::Variable:
+    return ((Variable *) term)->bruijn_index == index;
+  case Node::Type::Abstraction:
+    return occurrences(((Abstraction *) term)->term, index + 1);
+  case Node::Type::Application: {
+    int count = occurrences(((Application *) term)->term1, index);
+    if (count < 2) count += occurrences(((Application *) term)->term2, index);
+    return std::min(count, 2);
+  }
+  case Node::Type::Shift: {
+    Shift *closure = (Shift *) term;
+    if (closure->expanded) return occurrences(closure->expanded, index);
+    int count = index <= closure->cutoff ? occurrences(closure->term, index) : 0;
+    if (index - closure->offset > closure->cutoff) count += occurrences(closure->term, index - closure->offset);
+    return std::min(count, 2);
+  }
+  case Node::Type::Substitution: {
+    Substitution *closure = (Substitution *) term;
+    if (closure->expanded) return occurrences(closure->expanded, index);
+    if (index < closure->depth) return occurrences(closure->term, index);
+    int count = occurrences(closure->term, index + 1);
+    int replaced = count < 2 ? occurrences(closure->term, closure->depth) : 0;
+    if (replaced > 0) count += replaced * occurrences(closure->argument, index - closure->depth + 1);
+    return std::min(count, 2);
+  }
+  default:
+    return 0;
+  }
+}
+
+AST::Node *AST::expand(Node *node) {
+  // Results can nest as deep as any numeral, so the pending work is kept on
+  // a stack: a task either expands a term, or rebuilds the node whose
+  // children were expanded last. Binders stay on the bindings while their
+  // body is expanded, as substitutions name free variables from there
+  class Task {
+  public:
+    enum class Kind { Visit, Bind, Apply, Assign } kind;
+    Node *node;
+  };
+  std::vector<Task> tasks { { Task::Kind::Visit, node } };
+  std::vector<Node *> results;
+
+  try {
+    while (!tasks.empty()) {
+      Task task = tasks.back();
+      tasks.pop_back();
+      node = task.node;
+
+      switch (task.kind) {
+      case Task::Kind::Visit:
+        node = node->view();
+        if (node->type == Node::Type::Abstraction) {
+          bindings.push_back((Abstraction *) node);
+          ++bind_count;
+          tasks.push_back({ Task::Kind::Bind, node });
+          tasks.push_back({ Task::Kind::Visit, ((Abstraction *) node)->term });
+        }
+        else if (node->type == Node::Type::Application) {
+          tasks.push_back({ Task::Kind::Apply, node });
+          tasks.push_back({ Task::Kind::Visit, ((Application *) node)->term2 });
+          tasks.push_back({ Task::Kind::Visit, ((Application *) node)->term1 });
+        }
+        else if (node->type == Node::Type::Assignment) {
+          tasks.push_back({ Task::Kind::Assign, node });
+          tasks.push_back({ Task::Kind::Visit, ((Assignment *) node)->term });
+        }
+        else {
+          results.push_back(node->share());
+        }
+        break;
+      case Task::Kind::Bind: {
+        Abstraction *abstraction = (Abstraction *) node;
+        --bind_count;
+        bindings.pop_back();
+
+        Node *body = results.back();
+        if (body == abstraction->term) {
+          body->release();
+          results.back() = node->share();
+        }
+        else {
+          results.back() = new Abstraction(abstraction->name, body, abstraction->position, abstraction->length, abstraction->previous_bind);
+        }
+        break;
+      }
+      case Task::Kind::Apply: {
+        Application *application = (Application *) node;
+        Node *term2 = results.back();
+        results.pop_back();
+        Node *term1 = results.back();
+
+        if (term1 == application->term1 and term2 == application->term2) {
+          term1->release();
+          term2->release();
+          results.back() = node->share();
+        }
+        else {
+          results.back() = new Application(term1, term2, application->position, application->length);
+        }
+        break;
+      }
+      case Task::Kind::Assign: {
+        Assignment *assignment = (Assignment *) node;
+        Node *term = results.back();
+
+        if (term == assignment->term) {
+          term->release();
+          results.back() = node->share();
+        }
+        else {
+          results.back() = new Assignment(assignment->name, term, assignment->position, assignment->length);
+        }
+        break;
+      }
+      }
+    }
+  }
+  catch (const ParserException &exception) {
+    for (Node *result : results) {
+      result->release();
+    }
+    throw;
+  }
+
+  return results.back();
+}
+
+std::string AST::write(Node *node) {
+  // Terms are written into one string from a stack of tasks, as they can
+  // nest as deep as any numeral; a task writes either a term or a piece of
+  // text, or takes a binder off the bindings once its body is written
+  class Task {
+  public:
+    enum class Kind { Visit, Text, Unbind } kind;
+    Node *node;
+    const char *text;
+  };
+  std::vector<Task> tasks { { Task::Kind::Visit, node, nullptr } };
+  std::string output;
+
+  while (!tasks.empty()) {
+    Task task = tasks.back();
+    tasks.pop_back();
+
+    if (task.kind == Task::Kind::Text) {
+      output += task.text;
+      continue;
+    }
+    if (task.kind == Task::Kind::Unbind) {
+      --bind_count;
+      bindings.pop_back();
+      continue;
+    }
+
+    node = task.node->view();
+    switch (node->type) {
+    case Node::Type::Abstraction: {
+      Abstraction *abstraction = (Abstraction *) node;
+      output += C_LMB "\\" C_ARG + Symbols::get_name(abstraction->name) + C_DOT ".";
+      bindings.push_back(abstraction);
+      ++bind_count;
+      tasks.push_back({ Task::Kind::Text, nullptr, C_RES });
+      tasks.push_back({ Task::Kind::Unbind, nullptr, nullptr });
+      tasks.push_back({ Task::Kind::Visit, abstraction->term, nullptr });
+      break;
+    }
+    case Node::Type::Application: {
+      // Pushed the other way round, the argument first
+      Node *term1 = ((Application *) node)->term1->view(), *term2 = ((Application *) node)->term2->view();
+      if (term2->type == Node::Type::Application) {
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM "]" });
+        tasks.push_back({ Task::Kind::Visit, term2, nullptr });
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM "[" });
+      }
+      else if (term2->type == Node::Type::Abstraction) {
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM ")" });
+        tasks.push_back({ Task::Kind::Visit, term2, nullptr });
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM "(" });
+      }
+      else {
+        tasks.push_back({ Task::Kind::Visit, term2, nullptr });
+      }
+
+      if (term1->type == Node::Type::Abstraction) {
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM ") " });
+        tasks.push_back({ Task::Kind::Visit, term1, nullptr });
+        tasks.push_back({ Task::Kind::Text, nullptr, C_SYM "(" });
+      }
+      else {
+        tasks.push_back({ Task::Kind::Text, nullptr, " " });
+        tasks.push_back({ Task::Kind::Visit, term1, nullptr });
+      }
+      break;
+    }
+    case Node::Type::Assignment:
+      output += C_ASG + Symbols::get_name(((Assignment *) node)->name) + C_SYM " = ";
+      tasks.push_back({ Task::Kind::Text, nullptr, C_RES });
+      tasks.push_back({ Task::Kind::Visit, ((Assignment *) node)->term, nullptr });
+      break;
+    default:
+      output += node->to_string();
+      break;
+    }
+  }
+
+  return output;
+}
+
+AST::Node *AST::update_names(Node *node, std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) {
+  // Definitions can nest as deep as any numeral, so abstractions and
+  // applications are rebuilt from a stack of tasks; every other node
+  // renames itself. A binder that hides another of the same name keeps
+  // the level of the hidden one, which is restored after its body
+  class Task {
+  public:
+    enum class Kind { Visit, Bind, Apply } kind;
+    Node *node;
+    int level;
+  };
+  std::vector<Task> tasks { { Task::Kind::Visit, node, 0 } };
+  std::vector<Node *> results;
+
+  try {
+    while (!tasks.empty()) {
+      Task task = tasks.back();
+      tasks.pop_back();
+      node = task.node;
+
+      switch (task.kind) {
+      case Task::Kind::Visit:
+        node = node->view();
+        if (node->type == Node::Type::Abstraction) {
+          Abstraction *abstraction = (Abstraction *) node;
+          int level = -1;
+          auto entry = binds.find(abstraction->name);
+          if (entry == binds.end()) {
+            binds.insert({ abstraction->name, bind_count });
+          }
+          else {
+            level = entry->second;
+            entry->second = bind_count;
+          }
+          ++bind_count;
+          tasks.push_back({ Task::Kind::Bind, node, level });
+          tasks.push_back({ Task::Kind::Visit, abstraction->term, 0 });
+        }
+        else if (node->type == Node::Type::Application) {
+          tasks.push_back({ Task::Kind::Apply, node, 0 });
+          tasks.push_back({ Task::Kind::Visit, ((Application *) node)->term2, 0 });
+          tasks.push_back({ Task::Kind::Visit, ((Application *) node)->term1, 0 });
+        }
+        else {
+          results.push_back(node->update_name_shadowing(binds, position, length));
+        }
+        break;
+      case Task::Kind::Bind: {
+        Abstraction *abstraction = (Abstraction *) node;
+        --bind_count;
+        if (task.level < 0) binds.erase(abstraction->name);
+        else binds[abstraction->name] = task.level;
+
+        Node *term = results.back();
+        int previous_bind = task.level < 0 ? abstraction->previous_bind : task.level;
+        if (term == abstraction->term and previous_bind == abstraction->previous_bind
+          and abstraction->position == position and abstraction->length == length) {
+          term->release();
+          results.back() = node->share();
+        }
+        else {
+          results.back() = new Abstraction(abstraction->name, term, position, length, previous_bind);
+        }
+        break;
+      }
+      case Task::Kind::Apply: {
+        Application *application = (Application *) node;
+        Node *term2 = results.back();
+        results.pop_back();
+        Node *term1 = results.back();
+
+        if (term1 == application->term1 and term2 == application->term2
+          and application->position == position and application->length == length) {
+          term1->release();
+          term2->release();
+          results.back() = node->share();
+        }
+        else {
+          results.back() = new Application(term1, term2, position, length);
+        }
+        break;
+      }
+      }
+    }
+  }
+  catch (const ParserException &exception) {
+    for (Node *result : results) {
+      result->release();
+    }
+    throw;
+  }
+
+  return results.back();
+}
+
+std::string AST::read_back(Node *node) {
+  bindings = std::vector<Abstraction *>();
+  return read_back_term(node);
+}
+
+std::string AST::read_back_term(Node *node) {
+  if (node->get_type() != Node::Type::Abstraction) return "";
+  Abstraction *abstraction = (Abstraction *) node;
+
+  // Booleans: \a.\b.a and \a.\b.b (which is also zero and the empty list)
+  Node *body = abstraction->term;
+  if (body->get_type() == Node::Type::Abstraction) {
+    Node *inner = ((Abstraction *) body)->term;
+    if (inner->get_type() == Node::Type::Variable) {
+      int index = ((Variable *) inner)->bruijn_index;
+      if (index == 2) return C_CON "true" C_RES;
+      if (index == 1) return C_CON "false" C_RES;
+    }
+
+    long long value;
+    if (read_number(node, value)) return C_NUM + std::to_string(value) + C_RES;
+    return "";
+  }
+
+  // Pairs: \s.s A B, and lists as pairs nested in the second element
+  std::vector<Abstraction *> pairs;
+  Node *tail = node;
+  while (tail->get_type() == Node::Type::Abstraction) {
+    Node *pair = ((Abstraction *) tail)->term;
+    if (pair->get_type() != Node::Type::Application) break;
+    Node *selector = ((Application *) pair)->term1;
+    if (selector->get_type() != Node::Type::Application) break;
+    Node *first = ((Application *) selector)->term1;
+    if (first->get_type() != Node::Type::Variable or ((Variable *) first)->bruijn_index != 1) break;
+
+    for (int index : ((Application *) selector)->term2->free_variables()) {
+      if (index <= (int) pairs.size() + 1) return "";
+    }
+    pairs.push_back((Abstraction *) tail);
+    tail = ((Application *) pair)->term2;
+  }
+  if (pairs.empty()) return "";
+
+  for (int index : tail->free_variables()) {
+    if (index <= (int) pairs.size()) return "";
+  }
+
+  bool is_list = false;
+  Node *end = tail;
+  size_t constants = dictionary.size() + (names ? names->overlay.size() : 0);
+  for (size_t i = 0; i < constants and end->get_type() == Node::Type::Constant; ++i) {
+    Node *value = get_constant(((Constant *) end)->name);
+    if (!value) break;
+    end = value;
+  }
+  if (end->get_type() == Node::Type::Abstraction) {
+    Node *nil = ((Abstraction *) end)->term;
+    if (nil->get_type() == Node::Type::Abstraction) {
+      nil = ((Abstraction *) nil)->term;
+      // \a.\b.b
+      if (nil->get_type() == Node::Type::Variable and ((Variable *) nil)->bruijn_index == 1) is_list = true;
+      // \x.\a.\b.a
+      if (nil->get_type() == Node::Type::Abstraction) {
+        Node *inner = ((Abstraction *) nil)->term;
+        if (inner->get_type() == Node::Type::Variable and ((Variable *) inner)->bruijn_index == 2) is_list = true;
+      }
+    }
+  }
+
+  std::vector<std::string> elements;
+  for (Abstraction *pair : pairs) {
+    bindings.push_back(pair);
+    ++bind_count;
+    Node *element = ((Application *) ((Application *) pair->term)->term1)->term2;
+    std::string string = read_back_term(element);
+    elements.push_back(string == "" ? element->to_string() : string);
+  }
+  if (!is_list) {
+    std::string string = read_back_term(tail);
+    elements.push_back(string == "" ? tail->to_string() : string);
+  }
+  bind_count -= pairs.size();
+  bindings.resize(bindings.size() - pairs.size());
+
+  std::string output;
+  if (is_list) {
+    output = C_SYM "[";
+    for (size_t i = 0; i < elements.size(); ++i) {
+      output += (i ? C_SYM ", " : "") + elements[i];
+    }
+    return output + C_SYM "]" C_RES;
+  }
+  else {
+    // <a, <b, c>> is printed as <a, b, c>
+    output = C_SYM "<";
+    for (size_t i = 0; i < elements.size(); ++i) {
+      output += (i ? C_SYM ", " : "") + elements[i];
+    }
+    return output + C_SYM ">" C_RES;
+  }
+}
+
+bool AST::read_number(Node *node, long long &value) {
+  node = node->view();
+  if (node->get_type() == Node::Type::Number) {
+    value = ((Number *) node)->value;
+    return true;
+  }
+  if (node->get_type() != Node::Type::Abstraction) return false;
+
+  // Church numerals: \f.\x.f (f (... x)), and \f.f for one after eta-reduction
+  Node *body = ((Abstraction *) node)->term->view();
+  if (body->get_type() == Node::Type::Variable and ((Variable *) body)->bruijn_index == 1) {
+    value = 1;
+    return true;
+  }
+  if (body->get_type() != Node::Type::Abstraction) return false;
+
+  long long count = 0;
+  body = ((Abstraction *) body)->term->view();
+  while (body->get_type() == Node::Type::Application
+    and ((Application *) body)->term1->view()->get_type() == Node::Type::Variable
+    and ((Variable *) ((Application *) body)->term1->view())->bruijn_index == 2) {
+    body = ((Application *) body)->term2->view();
+    ++count;
+  }
+
+  if (body->get_type() == Node::Type::Variable and ((Variable *) body)->bruijn_index == 1) {
+    value = count;
+    return true;
+  }
+  return false;
+}
+
+std::string AST::to_result_string(Node *node) {
+  if (printing == Printing::Let) return to_let_string(node);
+  if (printing == Printing::Dag) return to_dag_string(node);
+  return to_string(node);
+}
+
+uint32_t AST::number_subterms(Node *node) {
+  // Subterms are numbered children first, and an application or abstraction
+  // is known by the numbers of its children, so a single walk over the
+  // shared nodes finds every distinct subterm however often it is repeated
+  std::unordered_map<Node *, uint32_t> numbers;
+  std::vector<std::unordered_map<uint64_t, uint32_t>> distinct((int) Node::Type::Substitution + 1);
+  std::vector<std::pair<Node *, bool>> pending { { node->view(), false } };
+
+  while (!pending.empty()) {
+    auto [next, ready] = pending.back();
+    pending.pop_back();
+    if (numbers.count(next)) continue;
+
+    uint32_t a = 0, b = 0;
+    uint64_t key = 0;
+    switch (next->type) {
+    case Node::Type::Variable:
+      key = ((Variable *) next)->bruijn_index;
+      break;
+    case Node::Type::Constant:
+      key = ((Constant *) next)->name;
+      break;
+    case Node::Type::Number:
+      key = ((Number *) next)->value;
+      break;
+    case Node::Type::Operator:
+      key = ((Operator *) next)->symbol;
+      break;
+    case Node::Type::Abstraction: {
+      Node *body = ((Abstraction *) next)->term->view();
+      if (!ready) {
+        pending.push_back({ next, true });
+        pending.push_back({ body, false });
+        continue;
+      }
+      key = a = numbers[body];
+      break;
+    }
+    case Node::Type::Application: {
+      Node *function = ((Application *) next)->term1->view();
+      Node *argument = ((Application *) next)->term2->view();
+      if (!ready) {
+        pending.push_back({ next, true });
+        pending.push_back({ argument, false });
+        pending.push_back({ function, false });
+        continue;
+      }
+      a = numbers[function];
+      b = numbers[argument];
+      key = (uint64_t) a << 32 | b;
+      break;
+    }
+    default:
+      // Nothing else is left in a normal form; it would be shown as it is
+      key = (uintptr_t) next;
+      break;
+    }
+
+    auto [entry, inserted] = distinct[(int) next->type].insert({ key, (uint32_t) subterms.size() });
+    if (inserted) subterms.push_back({ next, a, b, next->type == Node::Type::Variable ? (int) key : 0 });
+    numbers[next] = entry->second;
+  }
+
+  // Children come first, so their lowest free indices are known by then
+  std::unordered_map<uint64_t, int> known;
+  for (uint32_t i = 0; i < subterms.size(); ++i) {
+    Subterm &subterm = subterms[i];
+    if (subterm.node->free_bound == 0) continue;
+    if (subterm.node->type == Node::Type::Application) {
+      int function = subterms[subterm.a].lowest, argument = subterms[subterm.b].lowest;
+      subterm.lowest = function and argument ? std::min(function, argument) : function + argument;
+    }
+    else if (subterm.node->type == Node::Type::Abstraction) {
+      int body = lowest_free(subterm.a, 1, known);
+      subterm.lowest = body ? body - 1 : 0;
+    }
+  }
+  return numbers[node->view()];
+}
+
+int AST::lowest_free(uint32_t subterm, int above, std::unordered_map<uint64_t, int> &known) {
+  // The smallest free index greater than above, or 0. The largest one, and
+  // the smallest, rule out most subterms without looking inside them
+  const Subterm &entry = subterms[subterm];
+  if (entry.node->free_bound <= above) return 0;
+  if (entry.lowest > above) return entry.lowest;
+
+  uint64_t key = (uint64_t) subterm << 32 | above;
+  auto found = known.find(key);
+  if (found != known.end()) return found->second;
+
+  int lowest = 0;
+  if (entry.node->type == Node::Type::Application) {
+    int function = lowest_free(entry.a, above, known), argument = lowest_free(entry.b, above, known);
+    lowest = function and argument ? std::min(function, argument) : function + argument;
+  }
+  else if (entry.node->type == Node::Type::Abstraction) {
+    int body = lowest_free(entry.a, above + 1, known);
+    lowest = body ? body - 1 : 0;
+  }
+  known[key] = lowest;
+  return lowest;
+}
+
+std::string AST::to_dag_string(Node *node) {
+  // Every distinct subterm once, children first and referred to by their
+  // place in the list, with variables as de Bruijn indices. The last one is
+  // the whole term
+  subterms.clear();
+  number_subterms(node);
+
+  std::string output;
+  for (size_t i = 0; i < subterms.size(); ++i) {
+    Node *subterm = subterms[i].node;
+    if (i) output += "; ";
+    switch (subterm->type) {
+    case Node::Type::Variable:
+      output += "var " + std::to_string(((Variable *) subterm)->bruijn_index);
+      break;
+    case Node::Type::Constant:
+      output += "con " + Symbols::get_name(((Constant *) subterm)->name);
+      break;
+    case Node::Type::Number:
+      output += "num " + std::to_string(((Number *) subterm)->value);
+      break;
+    case Node::Type::Operator:
+      output += "op " + std::string(1, ((Operator *) subterm)->symbol);
+      break;
+    case Node::Type::Abstraction:
+      output += "lam " + Symbols::get_name(((Abstraction *) subterm)->name) + " " + std::to_string(subterms[i].a);
+      break;
+    case Node::Type::Application:
+      output += "app " + std::to_string(subterms[i].a) + " " + std::to_string(subterms[i].b);
+      break;
+    default:
+      output += subterm->to_simplified_string();
+      break;
+    }
+  }
+  subterms.clear();
+  return output;
+}
+
+std::string AST::to_let_string(Node *node) {
+  subterms.clear();
+  uint32_t root = number_subterms(node);
+
+  // Names of lets must not be taken for a constant or a variable
+  auto taken = [](const std::string &prefix) {
+    for (const Subterm &subterm : subterms) {
+      Symbols::Id id;
+      if (subterm.node->type == Node::Type::Constant) id = ((Constant *) subterm.node)->name;
+      else if (subterm.node->type == Node::Type::Abstraction) id = ((Abstraction *) subterm.node)->name;
+      else continue;
+      const std::string &name = Symbols::get_name(id);
+      if (name.size() > prefix.size() and name.compare(0, prefix.size(), prefix) == 0
+        and name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) return true;
+    }
+    return false;
+  };
+  let_prefix = "s";
+  while (taken(let_prefix)) let_prefix += "s";
+
+  let_scopes.assign(1, 0);
+  last_scope = 0;
+  count_lets(root);
+
+  let_binders.clear();
+  let_scopes.assign(1, 0);
+  last_scope = 0;
+  lets.assign(1, "");
+  bool atomic;
+  std::string body = print_lets(root, atomic);
+  std::string output = lets[0] + body;
+
+  subterms.clear();
+  let_uses.clear();
+  let_names.clear();
+  lets.clear();
+  return output;
+}
+
+uint64_t AST::let_key(uint32_t subterm) {
+  // Copies of a subterm with free variables stand for the same term when
+  // the innermost binder they refer to is the same one, as are then all
+  // the others, at the same distance
+  size_t lowest = subterms[subterm].lowest;
+  uint32_t scope = lowest and lowest < let_scopes.size() ? let_scopes[let_scopes.size() - lowest] : 0;
+  return (uint64_t) subterm << 32 | scope;
+}
+
+void AST::count_lets(uint32_t subterm) {
+  // A repeated subterm is walked the first time only, so what it holds is
+  // counted once for all of its copies, as it is printed once
+  const Subterm &entry = subterms[subterm];
+  if (entry.node->type == Node::Type::Abstraction) {
+    if (let_uses[let_key(subterm)]++ > 0) return;
+    let_scopes.push_back(++last_scope);
+    count_lets(entry.a);
+    let_scopes.pop_back();
+  }
+  else if (entry.node->type == Node::Type::Application) {
+    if (let_uses[let_key(subterm)]++ > 0) return;
+    count_lets(entry.a);
+    count_lets(entry.b);
+  }
+}
+
+std::string AST::print_lets(uint32_t subterm, bool &atomic) {
+  // Scopes are numbered in the same order as they were counted, as both
+  // walks skip the same repeats
+  const Subterm &entry = subterms[subterm];
+  Node *node = entry.node;
+  atomic = true;
+  if (node->type == Node::Type::Variable) {
+    int index = ((Variable *) node)->bruijn_index;
+    if (index > 0 and index <= (int) let_binders.size())
+      return C_VAR + Symbols::get_name(let_binders[let_binders.size() - index]) + C_RES;
+    return C_VAR + std::to_string(index) + C_RES;
+  }
+  if (node->type != Node::Type::Abstraction and node->type != Node::Type::Application) return node->to_string();
+
+  uint64_t key = let_key(subterm);
+  bool repeated = let_uses[key] > 1;
+  if (repeated) {
+    auto name = let_names.find(key);
+    if (name != let_names.end()) return name->second;
+  }
+  size_t lowest = entry.lowest;
+  size_t scope = lowest and lowest < lets.size() ? lets.size() - lowest : 0;
+
+  std::string text;
+  if (node->type == Node::Type::Abstraction) {
+    Symbols::Id name = ((Abstraction *) node)->name;
+    let_binders.push_back(name);
+    let_scopes.push_back(++last_scope);
+    lets.emplace_back();
+    bool inner;
+    std::string body = print_lets(entry.a, inner);
+    text = C_LMB "\\" C_ARG + Symbols::get_name(name) + C_DOT "." + lets.back() + body + C_RES;
+    lets.pop_back();
+    let_scopes.pop_back();
+    let_binders.pop_back();
+  }
+  else {
+    bool function_atomic, argument_atomic;
+    std::string function = print_lets(entry.a, function_atomic);
+    std::string argument = print_lets(entry.b, argument_atomic);
+    Node::Type left = subterms[entry.a].node->type, right = subterms[entry.b].node->type;
+    if (!function_atomic and left == Node::Type::Abstraction) function = C_SYM "(" + function + C_SYM ")";
+    if (!argument_atomic and right == Node::Type::Application) argument = C_SYM "[" + argument + C_SYM "]";
+    if (!argument_atomic and right == Node::Type::Abstraction) argument = C_SYM "(" + argument + C_SYM ")";
+    text = function + " " + argument;
+  }
+  atomic = false;
+  if (!repeated) return text;
+
+  // The let goes at the start of the body of the innermost binder it
+  // refers to, or of the whole term, after the lets it uses itself
+  std::string name = C_CON + let_prefix + std::to_string(let_names.size() + 1) + C_RES;
+  lets[scope] += C_SYM "let " + name + C_SYM " = " + text + C_SYM " in ";
+  let_names[key] = name;
+  atomic = true;
+  return name;
+}
 
-void AST::print_error(const ParserException &exception, std::string expression) {
-  expression += " ";
+thread_local std::vector<AST::Abstraction *> AST::bindings;
+thread_local int AST::bind_count;
+
+std::vector<AST::Node *> AST::dictionary;
+std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, Symbols::Id>>> AST::normal_forms;
+std::vector<AST::Dependencies> AST::dependencies;
+std::vector<uint64_t> AST::revisions;
+std::atomic<uint64_t> AST::last_revision { 0 };
+std::atomic<uint64_t> AST::last_order { 0 };
+thread_local uint64_t AST::order = 0;
+std::mutex AST::indexing;
+thread_local AST::Namespace *AST::names = nullptr;
+thread_local std::vector<AST::Node *> AST::garbage;
+thread_local bool AST::collecting = false;
+thread_local bool AST::verbose = true;
+thread_local std::ostream *AST::output = &std::cout;
+AST::Engine AST::engine = AST::Engine::Tree;
+AST::Strategy AST::strategy = AST::Strategy::Applicative;
+AST::Printing AST::printing = AST::Printing::Tree;
+bool AST::show_steps = true;
+bool AST::infer_types = false;
+thread_local bool AST::checked = true;
+thread_local size_t AST::steps;
+size_t AST::max_steps = 10000000;
+std::chrono::milliseconds AST::time_limit { 0 };
+thread_local std::chrono::steady_clock::time_point AST::deadline;
+thread_local AST::Control *AST::control = nullptr;
+thread_local long AST::live_nodes = 0;
+thread_local const char *AST::stack_base;
+size_t AST::stack_limit = 4 << 20;
+thread_local std::vector<AST::Subterm> AST::subterms;
+thread_local std::unordered_map<uint64_t, int> AST::let_uses;
+thread_local std::unordered_map<uint64_t, std::string> AST::let_names;
+thread_local std::vector<Symbols::Id> AST::let_binders;
+thread_local std::vector<uint32_t> AST::let_scopes;
+thread_local std::vector<std::string> AST::lets;
+thread_local uint32_t AST::last_scope;
+thread_local std::string AST::let_prefix;
+thread_local std::vector<AST::Node *> AST::states;
+thread_local std::unordered_map<uint64_t, int> AST::state_hashes;
+size_t AST::state_window = 16;
+int AST::growth_window = 256;
+uint64_t AST::max_size = 1 << 20;
+
+void AST::print_error(const ParserException &exception, std::string_view source) {
+  std::string expression = std::string(source) + " ";
   size_t position = exception.get_position(), length = exception.get_length();
-  /*if (position >= expression.length()) {
+  if (position >= expression.length()) {
     position = 0;
     length = expression.length();
   }
-  else*/ if (position + length >= expression.length()) {
+  else if (position + length >= expression.length()) {
     length = expression.length() - position;
   }
 
-  std::cout << "\n" << exception.get_name() << "! " << exception.get_message() << " at " << position << ".\n"
+  *output << "\n" << exception.get_name() << "! " << exception.get_message() << " at " << position << ".\n"
     << "\033[31m" << expression.substr(0, position)
     << "\033[37;41m" << expression.substr(position, length)
     << "\033[;31m" << expression.substr(position + length)
@@ -1,45 +1,103 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <set>
+#include <ostream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
 
 #include "ParserExceptions.h"
+#include "Symbols.h"
+
+class TermStore;
 
 class AST {
 public:
+  enum class Engine {
+    Tree, Compact, Graph
+  };
+
+  enum class Strategy {
+    Applicative, Normal
+  };
+
+  // How results that are neither constants nor Church encodings are shown:
+  // as a tree, with repeated subterms bound once by let, or as the list of
+  // their distinct subterms
+  enum class Printing {
+    Tree, Let, Dag
+  };
+
   class Node;
   class Variable;
   class Abstraction;
   class Application;
+  class Number;
+  class Operator;
+  class Shift;
+  class Substitution;
 
   // NODES
 
   class Node {
   public:
     friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
     enum class Type {
-      Variable, Constant, Abstraction, Application, Assignment
+      Variable, Constant, Abstraction, Application, Assignment, Number, Operator,
+      Shift, Substitution
     };
 
     Node(Type type, size_t position, size_t length);
     virtual ~Node();
 
+    // Nodes live in the node heap, which knows their size when they go
+    static void *operator new(size_t size);
+    static void operator delete(void *block, size_t size);
+
     Type get_type() const;
     std::string get_type_string() const;
 
+    // Nodes are immutable once built and shared between terms, so every
+    // transformation returns a new reference and leaves its input untouched
+    Node *share();
+    void release();
+
   private:
     virtual const std::string to_string() = 0;
     virtual const std::string to_simplified_string() = 0;
-    virtual Node *copy() = 0;
-    virtual void offset_indexes(int offset, int current = 0) = 0;
+    virtual Node *offset_indexes(int offset, int current = 0) = 0;
     virtual std::set<int> free_variables(int current_index = 0) = 0;
-    virtual Node *beta_reduce(Node *new_term, int current_index = 0) = 0;
     virtual Node *simplify() = 0;
-    virtual void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length) = 0;
+    virtual Node *normalize() = 0;
+    virtual Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length) = 0;
+    virtual Node *view();
 
     const Type type;
+    int references;
+    // Largest free de Bruijn index, so closed subterms are never walked
+    int free_bound;
+    // Set once simplify finds nothing to reduce below this node. Subtrees
+    // whose progress depends on a constant's definition are never marked
+    std::atomic<bool> normal;
+    // Reachable from the dictionary, and so from terms reduced on several
+    // threads at once. Only these nodes count their references atomically
+    bool published;
+    // Some constant occurs below, so the constants a definition refers to
+    // are only looked for where there are any
+    bool has_constants;
+    // Structural hash over de Bruijn indices, ignoring binder names, and the
+    // number of nodes the term would have unshared
+    uint64_t hash;
+    uint64_t size;
     size_t position;
     size_t length;
   };
@@ -47,18 +105,20 @@ public:
   class Variable : public Node {
   public:
     friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
     Variable(int bruijn_index, size_t position, size_t length);
     ~Variable();
 
   private:
     const std::string to_string();
     const std::string to_simplified_string();
-    Node *copy();
-    void offset_indexes(int offset, int current = 0);
+    Node *offset_indexes(int offset, int current = 0);
     std::set<int> free_variables(int current_index = 0);
-    Node *beta_reduce(Node *new_term, int current_index = 0);
     Node *simplify();
-    void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length);
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
 
     int bruijn_index;
   };
@@ -66,62 +126,78 @@ public:
   class Constant : public Node {
   public:
     friend class AST;
-    Constant(std::string name, size_t position, size_t length);
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Constant(Symbols::Id name, size_t position, size_t length);
     ~Constant();
 
   private:
     const std::string to_string();
     const std::string to_simplified_string();
-    Node *copy();
-    void offset_indexes(int offset, int current = 0);
+    Node *offset_indexes(int offset, int current = 0);
     std::set<int> free_variables(int current_index = 0);
-    Node *beta_reduce(Node *new_term, int current_index = 0);
     Node *simplify();
-    void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length);
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
 
     Node *resolve();
 
-    std::string name;
+    Symbols::Id name;
   };
 
   class Abstraction : public Node {
   public:
     friend class AST;
-    Abstraction(std::string name, Node *term, size_t position, size_t length, int previous_bind = -1);
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    enum class Usage : unsigned char {
+      Unknown, Zero, One, Many
+    };
+
+    Abstraction(Symbols::Id name, Node *term, size_t position, size_t length, int previous_bind = -1);
     ~Abstraction();
 
   private:
     const std::string to_string();
     const std::string to_simplified_string();
-    Node *copy();
-    void offset_indexes(int offset, int current = 0);
+    Node *offset_indexes(int offset, int current = 0);
     std::set<int> free_variables(int current_index = 0);
-    Node *beta_reduce(Node *new_term, int current_index = 0);
     Node *simplify();
-    void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length);
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
 
     Node *eta_reduce();
+    Usage usage();
 
-    std::string name;
+    Symbols::Id name;
     Node *term;
     int previous_bind;
+    // How often the bound variable occurs in the body, counted the first
+    // time a redex asks and kept, as the body never changes
+    std::atomic<Usage> uses;
   };
 
   class Application : public Node {
   public:
     friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
     Application(Node *term1, Node *term2, size_t position, size_t length);
     ~Application();
 
   private:
     const std::string to_string();
     const std::string to_simplified_string();
-    Node *copy();
-    void offset_indexes(int offset, int current = 0);
+    Node *offset_indexes(int offset, int current = 0);
     std::set<int> free_variables(int current_index = 0);
-    Node *beta_reduce(Node *new_term, int current_index = 0);
     Node *simplify();
-    void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length);
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+
+    Node *rebuild(Node *function, Node *argument);
 
     Node *term1;
     Node *term2;
@@ -130,40 +206,334 @@ public:
   class Assignment : public Node {
   public:
     friend class AST;
-    Assignment(std::string name, Node *term, size_t position, size_t length);
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Assignment(Symbols::Id name, Node *term, size_t position, size_t length);
     ~Assignment();
 
   private:
     const std::string to_string();
     const std::string to_simplified_string();
-    Node *copy();
-    void offset_indexes(int offset, int current = 0);
+    Node *offset_indexes(int offset, int current = 0);
     std::set<int> free_variables(int current_index = 0);
-    Node *beta_reduce(Node *new_term, int current_index = 0);
     Node *simplify();
-    void update_name_shadowing(std::map<std::string, int> &binds, size_t position, size_t length);
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
 
-    std::string name;
+    Symbols::Id name;
     Node *term;
   };
 
-  static std::string to_string(Node *node);
+  class Number : public Node {
+  public:
+    friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Number(long long value, size_t position, size_t length);
+    ~Number();
+
+  private:
+    const std::string to_string();
+    const std::string to_simplified_string();
+    Node *offset_indexes(int offset, int current = 0);
+    std::set<int> free_variables(int current_index = 0);
+    Node *simplify();
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+
+    Node *to_church();
+
+    long long value;
+  };
+
+  class Operator : public Node {
+  public:
+    friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Operator(char symbol, size_t position, size_t length);
+    ~Operator();
+
+  private:
+    const std::string to_string();
+    const std::string to_simplified_string();
+    Node *offset_indexes(int offset, int current = 0);
+    std::set<int> free_variables(int current_index = 0);
+    Node *simplify();
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+
+    Node *apply(long long left, long long right);
+    static const char *evaluate(char symbol, long long left, long long right, long long &result);
+
+    char symbol;
+  };
+
+  // CLOSURES
+
+  // A term whose free variables above cutoff are still to be moved by offset
+  class Shift : public Node {
+  public:
+    friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Shift(Node *term, int offset, int cutoff);
+    ~Shift();
+
+  private:
+    const std::string to_string();
+    const std::string to_simplified_string();
+    Node *offset_indexes(int offset, int current = 0);
+    std::set<int> free_variables(int current_index = 0);
+    Node *simplify();
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+    Node *view();
+
+    Node *push();
 
-  static std::string solve(Node *node, std::string expression);
+    Node *term;
+    int offset;
+    int cutoff;
+    Node *expanded;
+  };
+
+  // A term whose variable depth is still to be replaced by argument, with the
+  // variables above it moved down to close the gap
+  class Substitution : public Node {
+  public:
+    friend class AST;
+    friend class TermStore;
+    friend class TypeChecker;
+    friend class GraphReducer;
+    Substitution(Node *term, Node *argument, int depth);
+    ~Substitution();
+
+  private:
+    const std::string to_string();
+    const std::string to_simplified_string();
+    Node *offset_indexes(int offset, int current = 0);
+    std::set<int> free_variables(int current_index = 0);
+    Node *simplify();
+    Node *normalize();
+    Node *update_name_shadowing(std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+    Node *view();
+
+    Node *push();
+
+    Node *term;
+    Node *argument;
+    int depth;
+    Node *expanded;
+  };
+
+  // CONTROL
+
+  // Handed to an evaluation by whoever runs it. The evaluation gives up
+  // once cancelled is set, which a signal handler may do, and calls report
+  // with its progress every interval
+  class Control {
+  public:
+    std::atomic<bool> cancelled { false };
+    size_t steps = 0;
+    long nodes = 0;
+    void (*report)(const Control &control) = nullptr;
+    std::chrono::milliseconds interval { 500 };
+    std::chrono::steady_clock::time_point next_report;
+  };
+
+  // NAMESPACES
+
+  // The constants a definition refers to by name, and the definitions that
+  // refer to it
+  class Dependencies {
+  public:
+    std::vector<Symbols::Id> uses;
+    std::vector<Symbols::Id> users;
+  };
+
+  // A session's own definitions, layered over the dictionary that every
+  // session shares. A null value hides a constant of the dictionary
+  class Namespace {
+  public:
+    friend class AST;
+    Namespace() = default;
+    Namespace(const Namespace &) = delete;
+    ~Namespace();
+
+  private:
+    std::unordered_map<Symbols::Id, Node *> overlay;
+    // The overlay's functions by the hash of their normal form
+    std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, Symbols::Id>>> normal_forms;
+    // What the overlay's definitions refer to, and the revisions of the
+    // constants, shared or not, that the session's changes reached
+    std::unordered_map<Symbols::Id, Dependencies> dependencies;
+    std::unordered_map<Symbols::Id, uint64_t> revisions;
+  };
+
+  static std::string to_string(Node *node);
+  // As results are printed, in the way set_printing chose
+  static std::string to_result_string(Node *node);
+
+  static std::string solve(Node *node, std::string_view expression);
+  static void set_verbose(bool verbose);
+  static void set_engine(Engine engine);
+  static void set_strategy(Strategy strategy);
+  static void set_printing(Printing printing);
+  static void set_show_steps(bool show_steps);
+  static void set_infer_types(bool infer_types);
+  static void set_time_limit(std::chrono::milliseconds time_limit);
+  static void set_control(Control *control);
+  static bool cancelled();
+  static const char *checkpoint(size_t steps);
+  static void set_output(std::ostream &output);
+  static std::ostream &get_output();
 
   static void init();
-  static Node *get_constant(std::string name);
-  static void set_constant(std::string name, Node *value);
-  static void remove_constant(std::string name);
+  static void set_namespace(Namespace *names);
+  static Node *get_constant(Symbols::Id name);
+  static void set_constant(Symbols::Id name, Node *value);
+  static void remove_constant(Symbols::Id name);
+  static size_t count_constants();
+  // Makes room for every name interned so far, so that constants with
+  // those names can then be set from several threads at once
+  static void reserve_constants();
+  // Results are named after the equal constant that was defined first.
+  // Statements solved out of order are given their place in the file from
+  // a block of numbers reserved in advance; 0 numbers definitions as they
+  // are set
+  static uint64_t reserve_order(size_t count);
+  static void set_order(uint64_t order);
+  // Constants a term refers to, each once, and the name an assignment sets
+  static std::vector<Symbols::Id> references(Node *node);
+  static bool defines(Node *node, Symbols::Id &name, bool &deletes);
+  // Changes whenever the constant, or any constant it refers to directly or
+  // not, is set or deleted, so that what is derived from its definition can
+  // be kept until then
+  static uint64_t revision(Symbols::Id name);
+  // Whether some definition refers to the constant by name, and so changes
+  // meaning once it is set
+  static bool is_referenced(Symbols::Id name);
+  // Nodes alive on this thread
+  static long count_nodes();
   static void end();
 
 private:
   static std::string to_simplified_string(Node *node);
+  static bool equals(Node *left, Node *right);
+  static uint64_t hash_term(Node *node);
+  static void index_constant(Symbols::Id name, Node *value);
+  static void unindex_constant(Symbols::Id name, Node *value);
+  static void track(Symbols::Id name, Node *value);
+  static bool find_constant(Node *node, Symbols::Id &name);
+  static void publish(Node *node);
+  static Node *shift(Node *term, int offset, int cutoff = 0);
+  static Node *substitute(Node *term, Node *argument, int depth = 1);
+  static int occurrences(Node *term, int index);
+  static Node *expand(Node *node);
+  static std::string write(Node *node);
+  static Node *update_names(Node *node, std::unordered_map<Symbols::Id, int> &binds, size_t position, size_t length);
+  static Node *whnf(Node *node);
+  static Node *contract(Node *function, Node *argument, Node *redex);
+  static void count_step(Node *redex);
+  static bool timed_out();
+  static void check_stack(Node *node);
+  static uint64_t combine(uint64_t seed, uint64_t value);
+  static uint64_t add_sizes(uint64_t left, uint64_t right);
+  static void push_state(Node *state, size_t base);
+  static void pop_states(size_t base);
+  static void check_growth(Node *state, uint64_t &previous_size, int &growth);
+  static bool read_number(Node *node, long long &value);
+  static std::string read_back(Node *node);
+  static std::string read_back_term(Node *node);
+
+  // SHARED OUTPUT
+
+  // A distinct subterm of a result, up to the names of its variables. Its
+  // children are the numbers of distinct subterms too, so equal subterms are
+  // found without comparing them. A subterm stands for every node equal to
+  // it, the first of which gives it its names. Lowest is its smallest free
+  // de Bruijn index, or 0 if it is closed
+  class Subterm {
+  public:
+    Node *node;
+    uint32_t a;
+    uint32_t b;
+    int lowest;
+  };
 
-  static std::vector<Abstraction *> bindings;
-  static int bind_count;
-
-  static std::map<std::string, Node *> dictionary;
-
-  static void print_error(const ParserException &exception, std::string expression);
+  static uint32_t number_subterms(Node *node);
+  static int lowest_free(uint32_t subterm, int above, std::unordered_map<uint64_t, int> &known);
+  static std::string to_dag_string(Node *node);
+  static std::string to_let_string(Node *node);
+  static uint64_t let_key(uint32_t subterm);
+  static void count_lets(uint32_t subterm);
+  static std::string print_lets(uint32_t subterm, bool &atomic);
+
+  // Everything an evaluation keeps while it runs belongs to its thread, so
+  // several statements can be solved at once against the same dictionary
+  static thread_local std::vector<Abstraction *> bindings;
+  static thread_local int bind_count;
+
+  static std::vector<Node *> dictionary;
+  // Constants whose definitions are functions, by the hash of their normal
+  // form, so that results can be printed as the constant they equal. Each
+  // hash keeps its constants in the order they were defined
+  static std::unordered_map<uint64_t, std::vector<std::pair<uint64_t, Symbols::Id>>> normal_forms;
+  // What the dictionary's definitions refer to, and the revision of every
+  // constant by its id
+  static std::vector<Dependencies> dependencies;
+  static std::vector<uint64_t> revisions;
+  static std::atomic<uint64_t> last_revision;
+  static std::atomic<uint64_t> last_order;
+  static thread_local uint64_t order;
+  static std::mutex indexing;
+  static thread_local Namespace *names;
+  static thread_local std::vector<Node *> garbage;
+  static thread_local bool collecting;
+  static thread_local bool verbose;
+  static thread_local std::ostream *output;
+  static Engine engine;
+  static Strategy strategy;
+  static Printing printing;
+  static bool show_steps;
+  static bool infer_types;
+  // Off while reducing a term whose type proves that it terminates
+  static thread_local bool checked;
+  static thread_local size_t steps;
+  static size_t max_steps;
+  static std::chrono::milliseconds time_limit;
+  static thread_local std::chrono::steady_clock::time_point deadline;
+  static thread_local Control *control;
+  static thread_local long live_nodes;
+  static thread_local const char *stack_base;
+  static size_t stack_limit;
+
+  static thread_local std::vector<Subterm> subterms;
+  // Distinct subterms met more than once, keyed by their number and the
+  // innermost binder they refer to (as under another binder they mean
+  // something else), and the names given to those already printed
+  static thread_local std::unordered_map<uint64_t, int> let_uses;
+  static thread_local std::unordered_map<uint64_t, std::string> let_names;
+  // Binders around the subterm being printed, each with the lets to open
+  // its body with, the first being those of the whole result
+  static thread_local std::vector<Symbols::Id> let_binders;
+  static thread_local std::vector<uint32_t> let_scopes;
+  static thread_local std::vector<std::string> lets;
+  static thread_local uint32_t last_scope;
+  static thread_local std::string let_prefix;
+
+  // Terms being reduced by the evaluations now on the call stack, and the
+  // last few states each of them went through
+  static thread_local std::vector<Node *> states;
+  static thread_local std::unordered_map<uint64_t, int> state_hashes;
+  static size_t state_window;
+  static int growth_window;
+  static uint64_t max_size;
+
+  static void print_error(const ParserException &exception, std::string_view expression);
 };
\ No newline at end of file
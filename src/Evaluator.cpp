@@ -0,0 +1,55 @@
+#include <iostream>
+#include <csignal>
+
+#include <unistd.h>
+
+#include "Evaluator.h"
+#include "NodeHeap.h"
+
+void Evaluator::start() {
+  struct sigaction action {};
+  action.sa_handler = interrupt;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+
+  // Progress is only drawn for someone watching a terminal
+  progress = isatty(STDERR_FILENO);
+  AST::set_control(&control);
+}
+
+void Evaluator::run(const std::function<void()> &job) {
+  control.cancelled = false;
+  control.report = progress ? report : nullptr;
+  control.next_report = std::chrono::steady_clock::now() + control.interval;
+
+  busy = true;
+  job();
+  busy = false;
+}
+
+void Evaluator::stop() {
+  AST::set_control(nullptr);
+  signal(SIGINT, SIG_DFL);
+}
+
+void Evaluator::interrupt(int signal) {
+  // At the prompt, Ctrl-C still ends the program
+  if (!busy) {
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+    return;
+  }
+  control.cancelled = true;
+}
+
+void Evaluator::report(const AST::Control &control) {
+  // Redrawn in place; whatever the statement prints next starts on a new
+  // line and leaves the last count above it
+  std::cerr << "\r\033[K" << control.steps << " steps, " << control.nodes << " live nodes, "
+    << (NodeHeap::stats().heap_bytes >> 20) << " MB of node heap" << std::flush;
+}
+
+AST::Control Evaluator::control;
+bool Evaluator::progress = false;
+std::atomic<bool> Evaluator::busy { false };
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+#include <atomic>
+#include <chrono>
+
+#include "AST.h"
+
+// Runs the prompt's statements so that Ctrl-C cancels a long reduction and
+// gives the prompt back with every constant defined so far, and so that
+// long reductions show how far they got
+class Evaluator {
+public:
+  static void start();
+  static void run(const std::function<void()> &job);
+  static void stop();
+
+private:
+  Evaluator() = default;
+
+  static void interrupt(int signal);
+  static void report(const AST::Control &control);
+
+  static AST::Control control;
+  static bool progress;
+  // Read by the signal handler, so it has to be lock-free
+  static std::atomic<bool> busy;
+};
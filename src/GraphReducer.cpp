@@ -0,0 +1,528 @@
+#include <limits>
+
+#include "GraphReducer.h"
+
+AST::Node *GraphReducer::normalize(AST::Node *node) {
+  cells.clear();
+  instances.clear();
+  steps = 0;
+  position = node->position;
+  length = node->length;
+
+  try {
+    // The statement is compiled like a definition and copied out of the
+    // code at once, so the code only ever holds definitions
+    Index start = code.size();
+    Index term;
+    try {
+      auto [needs, root] = compile(node);
+      term = instantiate(start, code.size(), root);
+      code.resize(start);
+    }
+    catch (const ParserException &exception) {
+      code.resize(start);
+      throw;
+    }
+
+    AST::Node *output = read_back(term);
+    cells.clear();
+    instances.clear();
+    return output;
+  }
+  catch (const ParserException &exception) {
+    cells.clear();
+    instances.clear();
+    throw;
+  }
+}
+
+void GraphReducer::define(Symbols::Id name, AST::Node *value) {
+  lookup(name, value);
+}
+
+void GraphReducer::clear() {
+  for (auto &[name, entry] : compiled) {
+    entry.definition->release();
+  }
+  compiled.clear();
+  code.clear();
+  dead = 0;
+}
+
+GraphReducer::Index GraphReducer::make(std::vector<Cell> &store, Tag tag, uint32_t a, uint32_t b, char symbol) {
+  if (store.size() >= std::numeric_limits<Index>::max())
+    throw error("Graph is full");
+  store.push_back({ tag, symbol, a, b });
+  return store.size() - 1;
+}
+
+GraphReducer::Index GraphReducer::make_number(std::vector<Cell> &store, long long value) {
+  unsigned long long bits = value;
+  return make(store, Tag::Number, (uint32_t) bits, (uint32_t) (bits >> 32));
+}
+
+long long GraphReducer::get_number(const Cell &cell) {
+  return (long long) ((unsigned long long) cell.b << 32 | cell.a);
+}
+
+std::pair<int, GraphReducer::Index> GraphReducer::compile(AST::Node *node) {
+  // Bracket abstraction over de Bruijn indices, after Kiselyov: each term
+  // becomes code expecting the values of its innermost n variables, the
+  // outermost first, so binders themselves compile to nothing. Definitions
+  // nest as deep as any numeral, so the pending work is kept on a stack: a
+  // task either compiles a term, or closes an abstraction or an application
+  // over the code of its parts
+  class Task {
+  public:
+    enum class Kind { Compile, Abstract, Apply } kind;
+    AST::Node *node;
+  };
+  std::vector<Task> tasks { { Task::Kind::Compile, node } };
+  std::vector<std::pair<int, Index>> results;
+
+  while (!tasks.empty()) {
+    Task task = tasks.back();
+    tasks.pop_back();
+
+    if (task.kind == Task::Kind::Abstract) {
+      auto &[needs, body] = results.back();
+      if (needs > 0) {
+        --needs;
+        continue;
+      }
+      Index constant = make(code, Tag::Combinator, 0, 0, 'K');
+      body = make(code, Tag::Application, constant, body);
+      continue;
+    }
+    if (task.kind == Task::Kind::Apply) {
+      auto [argument_needs, argument] = results.back();
+      results.pop_back();
+      auto [function_needs, function] = results.back();
+      results.back() = { std::max(function_needs, argument_needs), combine(function_needs, function, argument_needs, argument) };
+      continue;
+    }
+
+    node = task.node->view();
+    switch (node->get_type()) {
+    case AST::Node::Type::Variable: {
+      int index = ((AST::Variable *) node)->bruijn_index;
+      if (index < 1) throw RuntimeException("Unbound variable", node->position, node->length);
+      // Every binder between the variable and its own is skipped with a K
+      Index term = make(code, Tag::Combinator, 0, 0, 'I');
+      for (int needs = 1; needs < index; ++needs) {
+        term = combine(0, make(code, Tag::Combinator, 0, 0, 'K'), needs, term);
+      }
+      results.push_back({ index, term });
+      break;
+    }
+    case AST::Node::Type::Constant:
+      results.push_back({ 0, make(code, Tag::Constant, ((AST::Constant *) node)->name) });
+      break;
+    case AST::Node::Type::Abstraction:
+      tasks.push_back({ Task::Kind::Abstract, node });
+      tasks.push_back({ Task::Kind::Compile, ((AST::Abstraction *) node)->term });
+      break;
+    case AST::Node::Type::Application: {
+      AST::Application *application = (AST::Application *) node;
+      tasks.push_back({ Task::Kind::Apply, node });
+      tasks.push_back({ Task::Kind::Compile, application->term2 });
+      tasks.push_back({ Task::Kind::Compile, application->term1 });
+      break;
+    }
+    case AST::Node::Type::Number:
+      results.push_back({ 0, make_number(code, ((AST::Number *) node)->value) });
+      break;
+    case AST::Node::Type::Operator:
+      results.push_back({ 0, make(code, Tag::Operator, 0, 0, ((AST::Operator *) node)->symbol) });
+      break;
+    default:
+      throw RuntimeException("Invalid operation on assignment", node->position, node->length);
+    }
+  }
+  return results.back();
+}
+
+GraphReducer::Index GraphReducer::combine(int left_needs, Index left, int right_needs, Index right) {
+  // Code for the application of left to right, where either side may ignore
+  // the outer variables that only the other one uses. Each outer variable
+  // wraps the code once more, so the wrapping is a loop; the only nested
+  // call has nothing on its left to share and so never goes deeper
+  auto leaf = [](char symbol) { return make(code, Tag::Combinator, 0, 0, symbol); };
+  auto apply = [](Index function, Index argument) { return make(code, Tag::Application, function, argument); };
+  auto is_identity = [](Index term) { return code[term].tag == Tag::Combinator and code[term].symbol == 'I'; };
+
+  while (true) {
+    if (left_needs == 0 and right_needs == 0) return apply(left, right);
+    if (left_needs == 0) {
+      // B f I is f, except for a constant, which the other engines unfold
+      // because it is applied
+      if (right_needs == 1 and is_identity(right) and code[left].tag != Tag::Constant) return left;
+      left = apply(leaf('B'), left);
+      --right_needs;
+      continue;
+    }
+    if (right_needs == 0) {
+      if (left_needs == 1 and is_identity(left)) return apply(apply(leaf('C'), left), right);
+      Index swapped = apply(apply(leaf('C'), leaf('C')), right);
+      right = left;
+      right_needs = left_needs - 1;
+      left = swapped;
+      left_needs = 0;
+      continue;
+    }
+    left = combine(0, leaf('S'), left_needs - 1, left);
+    --left_needs;
+    --right_needs;
+  }
+}
+
+const GraphReducer::Compiled &GraphReducer::lookup(Symbols::Id name, AST::Node *value) {
+  auto entry = compiled.find(name);
+  if (entry != compiled.end() and entry->second.definition == value) return entry->second;
+
+  if (entry != compiled.end()) {
+    entry->second.definition->release();
+    dead += entry->second.end - entry->second.start;
+    compiled.erase(entry);
+    if (dead > code.size() / 2 and dead > 1 << 16) compact();
+  }
+
+  Index start = code.size();
+  Index root;
+  try {
+    root = compile(value).second;
+  }
+  catch (const ParserException &exception) {
+    code.resize(start);
+    throw;
+  }
+  Compiled definition { value->share(), start, (Index) code.size(), root };
+  return compiled.insert({ name, definition }).first->second;
+}
+
+void GraphReducer::compact() {
+  // Code left behind by redefined constants is dropped by moving every live
+  // range down, which only shifts the references inside it
+  std::vector<Cell> live;
+  for (auto &[name, entry] : compiled) {
+    Index start = live.size();
+    for (Index i = entry.start; i < entry.end; ++i) {
+      Cell cell = code[i];
+      if (cell.tag == Tag::Application) {
+        cell.a = cell.a - entry.start + start;
+        cell.b = cell.b - entry.start + start;
+      }
+      live.push_back(cell);
+    }
+    entry.root = entry.root - entry.start + start;
+    entry.start = start;
+    entry.end = live.size();
+  }
+  code = std::move(live);
+  dead = 0;
+}
+
+GraphReducer::Index GraphReducer::instantiate(Index start, Index end, Index root) {
+  // Reduction overwrites the graph it runs on, so every statement works on
+  // copies of the code it uses; references only point within a range
+  Index base = cells.size();
+  if (base + (size_t) (end - start) >= std::numeric_limits<Index>::max())
+    throw error("Graph is full");
+  for (Index i = start; i < end; ++i) {
+    Cell cell = code[i];
+    if (cell.tag == Tag::Application) {
+      cell.a = cell.a - start + base;
+      cell.b = cell.b - start + base;
+    }
+    cells.push_back(cell);
+  }
+  return root - start + base;
+}
+
+thread_local std::vector<GraphReducer::Cell> GraphReducer::code;
+thread_local std::unordered_map<Symbols::Id, GraphReducer::Compiled> GraphReducer::compiled;
+thread_local size_t GraphReducer::dead;
+
+GraphReducer::Index GraphReducer::follow(Index term) {
+  Index target = term;
+  while (cells[target].tag == Tag::Indirection) {
+    target = cells[target].a;
+  }
+  // Chains are shortened as they are walked, or a redex that keeps
+  // reducing to its own argument would make every step walk them again
+  while (term != target) {
+    Index next = cells[term].a;
+    cells[term].a = target;
+    term = next;
+  }
+  return target;
+}
+
+GraphReducer::Index GraphReducer::resolve(Symbols::Id name) {
+  // One copy per statement, so a constant that is not a function is only
+  // reduced once however often the statement uses it
+  auto entry = instances.find(name);
+  if (entry != instances.end()) return entry->second;
+
+  AST::Node *value = AST::get_constant(name);
+  if (!value) return none;
+  const Compiled &definition = lookup(name, value);
+  Index instance = instantiate(definition.start, definition.end, definition.root);
+  instances.insert({ name, instance });
+  return instance;
+}
+
+GraphReducer::Index GraphReducer::whnf(Index term) {
+  // The spine is unwound onto a stack so that head reduction runs in a loop
+  // instead of recursing once per step
+  std::vector<Index> spine { follow(term) };
+
+  while (true) {
+    Index top = spine.back();
+    Cell cell = cells[top];
+
+    if (cell.tag == Tag::Application) {
+      Index function = follow(cell.a);
+      cells[top].a = function;
+      spine.push_back(function);
+      continue;
+    }
+
+    size_t available = spine.size() - 1;
+    if (available == 0) return top;
+    Index parent = spine[available - 1];
+
+    switch (cell.tag) {
+    case Tag::Constant: {
+      // Only applied constants are unfolded, as in the other engines, so
+      // the application itself can point at the definition from now on
+      Index value = resolve(cell.a);
+      if (value == none) return follow(spine.front());
+      count_step();
+      value = follow(value);
+      cells[parent].a = value;
+      spine.back() = value;
+      continue;
+    }
+    case Tag::Number: {
+      long long value = get_number(cell);
+      if (value < 0) throw error("Negative number applied as a Church numeral");
+      count_step();
+      Index numeral = to_church(value);
+      cells[parent].a = numeral;
+      spine.back() = numeral;
+      continue;
+    }
+    case Tag::Operator: {
+      if (available < 2) return follow(spine.front());
+      Index redex = spine[available - 2];
+      long long left, right, result;
+      // Operands that are not numbers yet leave the operator stuck
+      if (!read_number(cells[parent].b, left) or !read_number(cells[redex].b, right))
+        return follow(spine.front());
+      count_step();
+      if (const char *message = AST::Operator::evaluate(cell.symbol, left, right, result))
+        throw error(message);
+      unsigned long long bits = result;
+      cells[redex] = { Tag::Number, 0, (uint32_t) bits, (uint32_t) (bits >> 32) };
+      spine.resize(available - 1);
+      continue;
+    }
+    case Tag::Combinator:
+      break;
+    default:
+      return follow(spine.front());
+    }
+
+    size_t arity = cell.symbol == 'I' or cell.symbol == '+' ? 1 : cell.symbol == 'K' ? 2 : 3;
+    if (available < arity) return follow(spine.front());
+    Index redex = spine[available - arity];
+    Index x = cells[spine[available - 1]].b;
+    Index y = arity > 1 ? cells[spine[available - 2]].b : 0;
+    Index z = arity > 2 ? cells[spine[available - 3]].b : 0;
+    count_step();
+
+    // The redex is overwritten with its result, so every term sharing it
+    // sees the reduction done
+    switch (cell.symbol) {
+    case 'I':
+    case 'K':
+      cells[redex] = { Tag::Indirection, 0, follow(x), 0 };
+      break;
+    case 'S': {
+      Index left = make(cells, Tag::Application, x, z);
+      Index right = make(cells, Tag::Application, y, z);
+      cells[redex] = { Tag::Application, 0, left, right };
+      break;
+    }
+    case 'B': {
+      Index right = make(cells, Tag::Application, y, z);
+      cells[redex] = { Tag::Application, 0, x, right };
+      break;
+    }
+    case 'C': {
+      Index left = make(cells, Tag::Application, x, z);
+      cells[redex] = { Tag::Application, 0, left, y };
+      break;
+    }
+    case '+': {
+      Index value = whnf(x);
+      if (cells[value].tag != Tag::Number) throw error("Expected a number");
+      unsigned long long bits = get_number(cells[value]) + 1;
+      cells[redex] = { Tag::Number, 0, (uint32_t) bits, (uint32_t) (bits >> 32) };
+      break;
+    }
+    }
+
+    spine.resize(available - arity + 1);
+    spine.back() = follow(redex);
+  }
+}
+
+bool GraphReducer::read_number(Index term, long long &value) {
+  term = whnf(term);
+  while (cells[term].tag == Tag::Constant) {
+    Index definition = resolve(cells[term].a);
+    if (definition == none) return false;
+    count_step();
+    term = whnf(definition);
+  }
+
+  if (cells[term].tag == Tag::Number) {
+    value = get_number(cells[term]);
+    return true;
+  }
+
+  Index head = term;
+  while (cells[head].tag == Tag::Application) {
+    head = follow(cells[head].a);
+  }
+  if (cells[head].tag != Tag::Combinator) return false;
+
+  // Any other function has to be a Church numeral, which counts how many
+  // times it applies a successor to zero
+  Index successor = make(cells, Tag::Combinator, 0, 0, '+');
+  Index zero = make_number(cells, 0);
+  Index probe = make(cells, Tag::Application, make(cells, Tag::Application, term, successor), zero);
+  Index count = whnf(probe);
+  if (cells[count].tag != Tag::Number) throw error("Expected a number");
+  value = get_number(cells[count]);
+  return true;
+}
+
+GraphReducer::Index GraphReducer::to_church(long long value) {
+  // Zero is K I, and S B applies one more f
+  Index numeral = make(cells, Tag::Application, make(cells, Tag::Combinator, 0, 0, 'K'), make(cells, Tag::Combinator, 0, 0, 'I'));
+  Index successor = make(cells, Tag::Application, make(cells, Tag::Combinator, 0, 0, 'S'), make(cells, Tag::Combinator, 0, 0, 'B'));
+  for (long long i = 0; i < value; ++i) {
+    numeral = make(cells, Tag::Application, successor, numeral);
+  }
+  return numeral;
+}
+
+AST::Node *GraphReducer::read_back(Index term) {
+  // Normal forms can nest as deep as any numeral, so the read-back keeps its
+  // pending work on stacks: a task either reads a term, applies the head
+  // below its arguments, or binds a body
+  class Task {
+  public:
+    enum class Kind { Read, Apply, Bind } kind;
+    Index term;
+    uint32_t depth;
+  };
+  std::vector<Task> tasks { { Task::Kind::Read, term, 0 } };
+  std::vector<AST::Node *> results;
+
+  try {
+    while (!tasks.empty()) {
+      Task task = tasks.back();
+      tasks.pop_back();
+
+      if (task.kind == Task::Kind::Apply) {
+        size_t first = results.size() - task.term;
+        AST::Node *result = results[first - 1];
+        for (size_t i = first; i < results.size(); ++i) {
+          result = new AST::Application(result, results[i], position, length);
+        }
+        results.resize(first);
+        results.back() = result;
+        continue;
+      }
+      if (task.kind == Task::Kind::Bind) {
+        std::string name(1, 'a' + (task.depth - 1) % 26);
+        if (task.depth > 26) name += std::to_string((task.depth - 1) / 26);
+        AST::Abstraction *abstraction = new AST::Abstraction(Symbols::intern(name), results.back(), position, length);
+        results.back() = abstraction->eta_reduce();
+        abstraction->release();
+        continue;
+      }
+
+      if (tasks.size() > max_nesting) throw error("Reduction too deep");
+      count_step();
+      Index value = whnf(task.term);
+      std::vector<Index> arguments;
+      Index head = value;
+      while (cells[head].tag == Tag::Application) {
+        arguments.push_back(cells[head].b);
+        head = follow(cells[head].a);
+      }
+
+      Cell cell = cells[head];
+      switch (cell.tag) {
+      case Tag::Combinator: {
+        // A function: its body is what it gives for a fresh variable
+        Index variable = make(cells, Tag::Variable, task.depth + 1);
+        tasks.push_back({ Task::Kind::Bind, 0, task.depth + 1 });
+        tasks.push_back({ Task::Kind::Read, make(cells, Tag::Application, value, variable), task.depth + 1 });
+        continue;
+      }
+      case Tag::Variable:
+        results.push_back(new AST::Variable(task.depth - cell.a + 1, position, length));
+        break;
+      case Tag::Constant:
+        results.push_back(new AST::Constant(cell.a, position, length));
+        break;
+      case Tag::Number:
+        results.push_back(new AST::Number(get_number(cell), position, length));
+        break;
+      default:
+        results.push_back(new AST::Operator(cell.symbol, position, length));
+        break;
+      }
+
+      if (arguments.empty()) continue;
+      tasks.push_back({ Task::Kind::Apply, (Index) arguments.size(), task.depth });
+      for (Index argument : arguments) {
+        tasks.push_back({ Task::Kind::Read, argument, task.depth });
+      }
+    }
+  }
+  catch (const ParserException &exception) {
+    for (AST::Node *result : results) {
+      result->release();
+    }
+    throw;
+  }
+
+  return results.back();
+}
+
+void GraphReducer::count_step() {
+  if (++steps > max_steps)
+    throw error("Infinite lambda expression");
+  if (steps % 256 != 0) return;
+  if (const char *message = AST::checkpoint(steps))
+    throw error(message);
+}
+
+RuntimeException GraphReducer::error(const std::string message) {
+  return RuntimeException(message, position, length);
+}
+
+thread_local std::vector<GraphReducer::Cell> GraphReducer::cells;
+thread_local std::unordered_map<Symbols::Id, GraphReducer::Index> GraphReducer::instances;
+thread_local size_t GraphReducer::steps;
+thread_local size_t GraphReducer::position;
+thread_local size_t GraphReducer::length;
+size_t GraphReducer::max_steps = 10000000;
+size_t GraphReducer::max_nesting = 10000000;
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+#include "AST.h"
+
+// Compiles terms to S, K, I, B and C combinators and reduces them as a
+// graph, overwriting every redex with its result so that shared redexes are
+// reduced once. Normal forms are read back by applying functions to fresh
+// variables until only variables, constants and numbers are left at the head
+class GraphReducer {
+public:
+  typedef uint32_t Index;
+
+  enum class Tag : unsigned char {
+    Application, Combinator, Indirection, Variable, Constant, Number, Operator
+  };
+
+  // Application: a = function, b = argument
+  // Combinator: symbol = 'S', 'K', 'I', 'B', 'C', or '+' for the successor
+  //   used to read Church numerals
+  // Indirection: a = the node a reduced redex stands for now
+  // Variable: a = level of the binder being read back, counted from outside
+  // Constant: a = symbol id
+  // Number: a, b = low and high halves of the value
+  // Operator: symbol = operator character
+  class Cell {
+  public:
+    Tag tag;
+    char symbol;
+    uint32_t a;
+    uint32_t b;
+  };
+
+  static AST::Node *normalize(AST::Node *node);
+  // Compiles a definition as it is set, so later statements only copy it
+  static void define(Symbols::Id name, AST::Node *value);
+  static void clear();
+
+private:
+  GraphReducer() = default;
+
+  // A definition's code, kept in one range of code with its root. The
+  // definition is held so that it cannot be freed and another allocated at
+  // the same address while the code is kept
+  class Compiled {
+  public:
+    AST::Node *definition;
+    Index start;
+    Index end;
+    Index root;
+  };
+
+  static const Index none = UINT32_MAX;
+
+  // COMPILING
+
+  static Index make(std::vector<Cell> &store, Tag tag, uint32_t a = 0, uint32_t b = 0, char symbol = 0);
+  static Index make_number(std::vector<Cell> &store, long long value);
+  static long long get_number(const Cell &cell);
+
+  static std::pair<int, Index> compile(AST::Node *node);
+  static Index combine(int left_needs, Index left, int right_needs, Index right);
+  static const Compiled &lookup(Symbols::Id name, AST::Node *value);
+  static void compact();
+  static Index instantiate(Index start, Index end, Index root);
+
+  static thread_local std::vector<Cell> code;
+  static thread_local std::unordered_map<Symbols::Id, Compiled> compiled;
+  static thread_local size_t dead;
+
+  // REDUCING
+
+  static Index follow(Index term);
+  static Index resolve(Symbols::Id name);
+  static Index whnf(Index term);
+  static bool read_number(Index term, long long &value);
+  static Index to_church(long long value);
+  static AST::Node *read_back(Index term);
+  static void count_step();
+  static RuntimeException error(const std::string message);
+
+  static thread_local std::vector<Cell> cells;
+  static thread_local std::unordered_map<Symbols::Id, Index> instances;
+  static thread_local size_t steps;
+  static thread_local size_t position;
+  static thread_local size_t length;
+  static size_t max_steps;
+  static size_t max_nesting;
+};
@@ -0,0 +1,52 @@
+#include <limits>
+
+#include "Lexer.h"
+#include "Scanner.h"
+
+std::vector<Token> Lexer::tokenize(std::string_view source) {
+  if (source.size() >= std::numeric_limits<uint32_t>::max())
+    throw TokenException("Input too large", 0, 0);
+
+  std::vector<Token> tokens;
+  // Terms come to about one token for every two or three bytes, so this
+  // is too little only for the densest ones, which then grow once
+  tokens.reserve(source.size() / 4 + 1);
+
+  const char *begin = source.data();
+  const char *end = begin + source.size();
+  const char *ptr = begin;
+
+  while (true) {
+    ptr = Scanner::skip_space(ptr, end);
+    uint32_t start = ptr - begin;
+    if (ptr == end) {
+      tokens.push_back({ Token::Kind::End, start, 0 });
+      return tokens;
+    }
+
+    Token::Kind kind;
+    switch (*ptr) {
+    case '=': kind = Token::Kind::Assign; break;
+    case '.': kind = Token::Kind::Dot; break;
+    case '\\': kind = Token::Kind::Lambda; break;
+    case '(': kind = Token::Kind::Opening_p; break;
+    case ')': kind = Token::Kind::Closing_p; break;
+    case '+': kind = Token::Kind::Plus; break;
+    case '-': kind = Token::Kind::Minus; break;
+    case '*': kind = Token::Kind::Times; break;
+    case '/': kind = Token::Kind::Divided; break;
+    default:
+      if (Scanner::is_alpha(*ptr)) {
+        bool has_letters = false;
+        ptr = Scanner::skip_name(ptr, end, has_letters);
+        kind = has_letters ? Token::Kind::Name : Token::Kind::Number;
+        tokens.push_back({ kind, start, (uint32_t) (ptr - begin) - start });
+        continue;
+      }
+      kind = Token::Kind::Invalid;
+    }
+
+    ++ptr;
+    tokens.push_back({ kind, start, 1 });
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#include "ParserExceptions.h"
+
+// TOKENS
+
+class Token {
+public:
+  enum class Kind : unsigned char {
+    Name, Number, Assign, Dot, Lambda, Opening_p, Closing_p,
+    Plus, Minus, Times, Divided, Invalid, End
+  };
+
+  Kind kind;
+  uint32_t position;
+  uint32_t length;
+};
+
+class Lexer {
+public:
+  static std::vector<Token> tokenize(std::string_view source);
+
+private:
+  Lexer() = default;
+};
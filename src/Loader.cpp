@@ -0,0 +1,425 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <pthread.h>
+
+#include "Loader.h"
+#include "MappedFile.h"
+#include "Parser.h"
+#include "TypeChecker.h"
+#include "GraphReducer.h"
+
+bool Loader::load(const std::string &path) {
+  MappedFile file(path);
+  if (!file.is_open()) {
+    AST::get_output() << "\nCould not open \"" << path << "\": " << file.get_error() << "\n";
+    return false;
+  }
+
+  AST::set_verbose(false);
+  if (!run_parallel(file.get_view(), path)) run(file.get_view(), path);
+  AST::set_verbose(true);
+  return true;
+}
+
+void Loader::run(std::string_view source, const std::string &origin) {
+  Lines lines(source);
+  std::string_view remaining = source;
+  // An interrupted evaluation also stops the statements after it
+  while (!remaining.empty() and !AST::cancelled()) {
+    std::string_view statement = next_statement(remaining);
+    if (is_blank(statement)) continue;
+
+    AST::Node *node = Parser::parse(statement);
+    if (!node) {
+      if (origin != "")
+        AST::get_output() << "- In \"" << origin << "\", line " << lines.find(statement.data()) << "\n";
+      continue;
+    }
+
+    std::string result = AST::solve(node, statement);
+    node->release();
+    if (result == "") continue;
+    AST::get_output() << "\n= " << result << "\n";
+  }
+}
+
+void Loader::set_workers(int workers) {
+  // Statements of a file are all work for the CPU, so threads beyond the
+  // cores it has would only take turns
+  Loader::workers = std::min(workers, (int) std::max(1u, std::thread::hardware_concurrency()));
+}
+
+std::string_view Loader::next_statement(std::string_view &source) {
+  const char *end = (const char *) std::memchr(source.data(), ';', source.size());
+  size_t length = end ? end - source.data() : source.size();
+
+  std::string_view statement = source.substr(0, length);
+  source.remove_prefix(end ? length + 1 : length);
+
+  while (!statement.empty() and is_blank(statement.substr(0, 1))) {
+    statement.remove_prefix(1);
+  }
+  while (!statement.empty() and is_blank(statement.substr(statement.size() - 1))) {
+    statement.remove_suffix(1);
+  }
+  return statement;
+}
+
+bool Loader::is_blank(std::string_view statement) {
+  for (char c : statement) {
+    if (c != ' ' and c != '\t' and c != '\n' and c != '\r') return false;
+  }
+  return true;
+}
+
+Loader::Lines::Lines(std::string_view source):
+  source(source) {
+  //
+}
+
+size_t Loader::Lines::find(const char *position) {
+  if (starts.empty()) {
+    starts.push_back(source.data());
+    const char *end = source.data() + source.size();
+    for (const char *ptr = source.data(); (ptr = (const char *) std::memchr(ptr, '\n', end - ptr)); ++ptr) {
+      starts.push_back(ptr + 1);
+    }
+  }
+  return std::upper_bound(starts.begin(), starts.end(), position) - starts.begin();
+}
+
+bool Loader::run_parallel(std::string_view source, const std::string &origin) {
+  if (workers < 2) return false;
+
+  std::vector<Statement> statements;
+  std::string_view rest = source;
+  while (!rest.empty()) {
+    std::string_view statement = next_statement(rest);
+    if (!is_blank(statement)) statements.push_back({ statement });
+  }
+  // Small files are loaded faster than threads start
+  if (statements.size() < min_statements) return false;
+
+  // Parsing needs nothing but the statement itself. Whatever it prints is
+  // kept, to be shown when the statement's turn comes
+  std::atomic<size_t> next { 0 };
+  in_parallel([&] {
+    std::ostringstream output;
+    AST::set_output(output);
+    for (size_t i = next++; i < statements.size(); i = next++) {
+      Statement &statement = statements[i];
+      statement.node = Parser::parse(statement.source);
+      if (output.tellp() > 0) {
+        statement.output = output.str();
+        output.str("");
+      }
+      if (!statement.node) statement.done = true;
+    }
+    AST::set_output(std::cout);
+  }, nullptr);
+
+  Lines lines(source);
+  for (Statement &statement : statements) {
+    if (!statement.node)
+      statement.output += "- In \"" + origin + "\", line " + std::to_string(lines.find(statement.source.data())) + "\n";
+  }
+
+  if (!plan(statements, lines, origin)) {
+    for (Statement &statement : statements) {
+      if (!AST::cancelled()) {
+        AST::get_output() << statement.output;
+        if (statement.node) {
+          std::string result = AST::solve(statement.node, statement.source);
+          if (result != "") AST::get_output() << "\n= " << result << "\n";
+        }
+      }
+      if (statement.node) statement.node->release();
+    }
+    return true;
+  }
+
+  // Every name was interned while parsing, so the dictionary never has to
+  // grow while the workers set constants
+  AST::reserve_constants();
+  Loader::statements = &statements;
+  ready.clear();
+  running = 0;
+  remaining = 0;
+  control.cancelled = false;
+  uint64_t first = AST::reserve_order(statements.size());
+  for (size_t i = 0; i < statements.size(); ++i) {
+    statements[i].order = first + i;
+    if (statements[i].done) continue;
+    ++remaining;
+    if (statements[i].waiting == 0) ready.push_back(i);
+  }
+
+  // This thread shows what every statement printed, in file order, as soon
+  // as the statements before it are done too, and passes Ctrl-C on
+  size_t shown = 0;
+  auto show = [&] {
+    while (shown < statements.size() and statements[shown].done) {
+      AST::get_output() << statements[shown].output;
+      ++shown;
+    }
+  };
+  in_parallel(solve_ready, [&] {
+    std::unique_lock<std::mutex> guard(lock);
+    while (remaining > 0 and !(control.cancelled and running == 0)) {
+      finished.wait_for(guard, std::chrono::milliseconds(50));
+      if (AST::cancelled() and !control.cancelled) {
+        control.cancelled = true;
+        changed.notify_all();
+      }
+      show();
+    }
+  });
+
+  // Statements left undone after Ctrl-C never ran
+  for (; shown < statements.size(); ++shown) {
+    if (statements[shown].done) AST::get_output() << statements[shown].output;
+  }
+  for (Statement &statement : statements) {
+    if (statement.node) statement.node->release();
+  }
+  Loader::statements = nullptr;
+  return true;
+}
+
+bool Loader::plan(std::vector<Statement> &statements, Lines &lines, const std::string &origin) {
+  // A definition waits for the definitions of the constants it uses, and an
+  // expression, which may use any constant and be named after any of them,
+  // waits for everything before it and holds up everything after it. The
+  // order of the file has to be kept as a whole where a constant is set
+  // again, deleted, or used before it is set, here or by a definition
+  // loaded earlier, as what a definition sees of it then depends on which
+  // statements came first
+  std::unordered_map<Symbols::Id, size_t> defined;
+  std::unordered_set<Symbols::Id> used_early;
+  std::vector<size_t> since_barrier;
+  size_t barrier = statements.size();
+  bool ordered = false, forward = false;
+
+  auto depend = [&](size_t on, size_t statement) {
+    statements[on].dependents.push_back(statement);
+    ++statements[statement].waiting;
+  };
+
+  for (size_t i = 0; i < statements.size(); ++i) {
+    Statement &statement = statements[i];
+    if (!statement.node) continue;
+
+    Symbols::Id name;
+    bool deletes;
+    if (!AST::defines(statement.node, name, deletes)) {
+      if (barrier < statements.size()) depend(barrier, i);
+      for (size_t earlier : since_barrier) {
+        depend(earlier, i);
+      }
+      since_barrier.clear();
+      barrier = i;
+      continue;
+    }
+
+    if (deletes or defined.count(name) or AST::get_constant(name) or AST::is_referenced(name)) ordered = true;
+    if (used_early.count(name)) ordered = forward = true;
+
+    if (barrier < statements.size()) depend(barrier, i);
+    for (Symbols::Id used : AST::references(statement.node)) {
+      if (used == name) continue;
+      auto entry = defined.find(used);
+      if (entry != defined.end()) depend(entry->second, i);
+      else if (!AST::get_constant(used)) used_early.insert(used);
+    }
+    defined.insert({ name, i });
+    since_barrier.push_back(i);
+  }
+
+  if (forward) report_cycles(statements, lines, origin);
+  if (!ordered) return true;
+  for (Statement &statement : statements) {
+    statement.dependents.clear();
+    statement.waiting = 0;
+  }
+  return false;
+}
+
+void Loader::report_cycles(std::vector<Statement> &statements, Lines &lines, const std::string &origin) {
+  // Definitions that refer to each other, through any number of others, are
+  // the strongly connected components of the graph of references, found
+  // with Tarjan's algorithm run on a stack of its own
+  std::unordered_map<Symbols::Id, size_t> definition;
+  std::vector<size_t> definitions;
+  std::vector<std::vector<size_t>> edges;
+  for (size_t i = 0; i < statements.size(); ++i) {
+    Symbols::Id name;
+    bool deletes;
+    if (!statements[i].node or !AST::defines(statements[i].node, name, deletes) or deletes) continue;
+    if (definition.insert({ name, definitions.size() }).second) definitions.push_back(i);
+  }
+  edges.resize(definitions.size());
+  for (size_t i = 0; i < definitions.size(); ++i) {
+    for (Symbols::Id used : AST::references(statements[definitions[i]].node)) {
+      auto entry = definition.find(used);
+      if (entry != definition.end() and entry->second != i) edges[i].push_back(entry->second);
+    }
+  }
+
+  const size_t unvisited = SIZE_MAX;
+  std::vector<size_t> index(definitions.size(), unvisited), low(definitions.size());
+  std::vector<bool> on_stack(definitions.size(), false);
+  std::vector<size_t> stack;
+  std::vector<std::pair<size_t, size_t>> calls;
+  size_t counter = 0;
+
+  for (size_t root = 0; root < definitions.size(); ++root) {
+    if (index[root] != unvisited) continue;
+    calls.push_back({ root, 0 });
+    index[root] = low[root] = counter++;
+    stack.push_back(root);
+    on_stack[root] = true;
+
+    while (!calls.empty()) {
+      auto &[node, edge] = calls.back();
+      if (edge < edges[node].size()) {
+        size_t next = edges[node][edge++];
+        if (index[next] == unvisited) {
+          index[next] = low[next] = counter++;
+          stack.push_back(next);
+          on_stack[next] = true;
+          calls.push_back({ next, 0 });
+        }
+        else if (on_stack[next]) {
+          low[node] = std::min(low[node], index[next]);
+        }
+        continue;
+      }
+
+      size_t finished = node;
+      calls.pop_back();
+      if (!calls.empty()) low[calls.back().first] = std::min(low[calls.back().first], low[finished]);
+      if (low[finished] != index[finished]) continue;
+
+      std::vector<size_t> component;
+      size_t member;
+      do {
+        member = stack.back();
+        stack.pop_back();
+        on_stack[member] = false;
+        component.push_back(definitions[member]);
+      } while (member != finished);
+      if (component.size() < 2) continue;
+
+      std::sort(component.begin(), component.end());
+      std::string names;
+      for (size_t statement : component) {
+        Symbols::Id name;
+        bool deletes;
+        AST::defines(statements[statement].node, name, deletes);
+        names += (names.empty() ? "" : ", ") + Symbols::get_name(name);
+      }
+      AST::get_output() << "- In \"" << origin << "\", line " << lines.find(statements[component[0]].source.data())
+        << ": " << names << " refer to each other, so the file is loaded in order\n";
+    }
+  }
+}
+
+void Loader::in_parallel(const std::function<void()> &job, const std::function<void()> &wait) {
+  // Workers reduce terms as deep as the main thread does, so they get a
+  // stack of their own size rather than the platform default
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, worker_stack);
+  std::vector<pthread_t> threads;
+  for (int i = 0; i < workers; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, work, (void *) &job) == 0) threads.push_back(thread);
+  }
+  pthread_attr_destroy(&attributes);
+
+  if (threads.empty()) job();
+  if (wait) wait();
+  for (pthread_t thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+}
+
+void *Loader::work(void *job) {
+  (*(const std::function<void()> *) job)();
+  return nullptr;
+}
+
+void Loader::solve_ready() {
+  AST::set_verbose(false);
+  AST::set_control(&control);
+
+  std::ostringstream output;
+  AST::set_output(output);
+
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    changed.wait(guard, [] { return !ready.empty() or remaining == 0 or control.cancelled; });
+    if (remaining == 0 or control.cancelled) break;
+    size_t index = ready.front();
+    ready.pop_front();
+    ++running;
+    guard.unlock();
+
+    Statement &statement = (*statements)[index];
+    AST::set_order(statement.order);
+    std::string result = AST::solve(statement.node, statement.source);
+    AST::set_order(0);
+    if (result != "") output << "\n= " << result << "\n";
+    if (output.tellp() > 0) {
+      statement.output += output.str();
+      output.str("");
+    }
+
+    guard.lock();
+    --running;
+    --remaining;
+    statement.done = true;
+    for (size_t dependent : statement.dependents) {
+      if (--(*statements)[dependent].waiting == 0) ready.push_back(dependent);
+    }
+    // This worker goes on with one of the statements it made ready, so the
+    // others are only woken for the rest. Along a chain of definitions that
+    // keeps the work on one thread
+    if (remaining == 0 or control.cancelled) {
+      changed.notify_all();
+      finished.notify_one();
+    }
+    else {
+      for (size_t i = 1; i < ready.size(); ++i) {
+        changed.notify_one();
+      }
+    }
+  }
+  guard.unlock();
+
+  AST::set_output(std::cout);
+  AST::set_control(nullptr);
+  // Types and code kept by this thread hold definitions, which are released
+  // before the thread ends
+  TypeChecker::clear();
+  GraphReducer::clear();
+}
+
+int Loader::workers = std::max(1u, std::thread::hardware_concurrency());
+size_t Loader::min_statements = 64;
+size_t Loader::worker_stack = 64 << 20;
+std::vector<Loader::Statement> *Loader::statements = nullptr;
+std::deque<size_t> Loader::ready;
+size_t Loader::running = 0;
+size_t Loader::remaining = 0;
+AST::Control Loader::control;
+std::mutex Loader::lock;
+std::condition_variable Loader::changed;
+std::condition_variable Loader::finished;
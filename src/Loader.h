@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include "AST.h"
+
+class Loader {
+public:
+  static bool load(const std::string &path);
+  static void run(std::string_view source, const std::string &origin = "");
+  static void set_workers(int workers);
+
+private:
+  Loader() = default;
+
+  static std::string_view next_statement(std::string_view &source);
+  static bool is_blank(std::string_view statement);
+
+  // The lines of a file, for pointing out where its errors are. The starts
+  // of the lines are only found on the first lookup, and then searched
+  class Lines {
+  public:
+    Lines(std::string_view source);
+    size_t find(const char *position);
+
+  private:
+    std::string_view source;
+    std::vector<const char *> starts;
+  };
+
+  // PARALLEL LOADING
+
+  // A statement of a file loaded in parallel, with what parsing and solving
+  // it printed, which is shown in file order once it is done. It starts
+  // once every statement it depends on is done. Its order is where it
+  // stands in the file, which names its result
+  class Statement {
+  public:
+    std::string_view source;
+    AST::Node *node = nullptr;
+    uint64_t order = 0;
+    std::string output;
+    std::vector<size_t> dependents;
+    size_t waiting = 0;
+    bool done = false;
+  };
+
+  static bool run_parallel(std::string_view source, const std::string &origin);
+  static bool plan(std::vector<Statement> &statements, Lines &lines, const std::string &origin);
+  static void report_cycles(std::vector<Statement> &statements, Lines &lines, const std::string &origin);
+  static void in_parallel(const std::function<void()> &job, const std::function<void()> &wait);
+  static void *work(void *job);
+  static void solve_ready();
+
+  static int workers;
+  static size_t min_statements;
+  static size_t worker_stack;
+
+  static std::vector<Statement> *statements;
+  static std::deque<size_t> ready;
+  static size_t running;
+  static size_t remaining;
+  static AST::Control control;
+  static std::mutex lock;
+  // Workers wait for statements to become ready, this thread for all of
+  // them to be done
+  static std::condition_variable changed;
+  static std::condition_variable finished;
+};
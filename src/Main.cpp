@@ -1,11 +1,86 @@
 #include <iostream>
-#include <memory>
+#include <thread>
 #include "Parser.h"
+#include "Loader.h"
+#include "Server.h"
+#include "Evaluator.h"
 
 int main(int argc, const char *argv[]) {
   std::string expression;
-  std::unique_ptr<AST::Node> node;
+  std::string socket_path;
+  int workers = std::max(1u, std::thread::hardware_concurrency());
   AST::init();
+  Evaluator::start();
+
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = argv[i];
+    if (argument == "--arithmetic") {
+      Parser::set_arithmetic(true);
+    }
+    else if (argument == "--engine=tree") {
+      AST::set_engine(AST::Engine::Tree);
+    }
+    else if (argument == "--engine=compact") {
+      AST::set_engine(AST::Engine::Compact);
+    }
+    else if (argument == "--engine=graph") {
+      AST::set_engine(AST::Engine::Graph);
+    }
+    else if (argument == "--strategy=applicative") {
+      AST::set_strategy(AST::Strategy::Applicative);
+    }
+    else if (argument == "--strategy=normal") {
+      AST::set_strategy(AST::Strategy::Normal);
+    }
+    else if (argument == "--print=tree") {
+      AST::set_printing(AST::Printing::Tree);
+    }
+    else if (argument == "--print=let") {
+      AST::set_printing(AST::Printing::Let);
+    }
+    else if (argument == "--print=dag") {
+      AST::set_printing(AST::Printing::Dag);
+    }
+    else if (argument == "--no-steps") {
+      AST::set_show_steps(false);
+    }
+    else if (argument == "--types") {
+      AST::set_infer_types(true);
+    }
+    else if (argument.rfind("--serve=", 0) == 0) {
+      socket_path = argument.substr(8);
+    }
+    else if (argument.rfind("--workers=", 0) == 0) {
+      workers = std::atoi(argument.c_str() + 10);
+      if (workers < 1) {
+        std::cout << "Invalid worker count \"" << argument.substr(10) << "\"\n";
+        return 1;
+      }
+      Loader::set_workers(workers);
+    }
+    else if (argument.rfind("--timeout=", 0) == 0) {
+      int milliseconds = std::atoi(argument.c_str() + 10);
+      if (milliseconds < 1) {
+        std::cout << "Invalid timeout \"" << argument.substr(10) << "\"\n";
+        return 1;
+      }
+      AST::set_time_limit(std::chrono::milliseconds(milliseconds));
+    }
+    else if (argument.rfind("--", 0) == 0) {
+      std::cout << "Unknown option \"" << argument << "\"\n";
+      return 1;
+    }
+    else {
+      Evaluator::run([&] { Loader::load(argument); });
+    }
+  }
+
+  if (socket_path != "") {
+    Evaluator::stop();
+    int status = Server::serve(socket_path, workers);
+    AST::end();
+    return status;
+  }
 
   //std::getline(std::cin, expression);
   //expression = "(\b.b (\x y.y) (\x y.x)) \x y.x";
@@ -18,16 +93,10 @@ int main(int argc, const char *argv[]) {
     std::getline(std::cin, expression);
     if (expression == "") break;
 
-    node.reset(Parser::parse(expression));
-    if (!node) continue;
-
-    std::string result = AST::solve(node.get(), expression);
-    if (result == "") continue;
-    //std::cout << "Expression: " << AST::to_string(node.get()) << "\n";
-    //std::cout << "Result:     " << result << "\n";
-    std::cout << "\n= " << result << "\n";
+    Evaluator::run([&] { Loader::run(expression); });
   }
 
+  Evaluator::stop();
   AST::end();
   return 0;
 }
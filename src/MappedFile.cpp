@@ -0,0 +1,60 @@
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedFile.h"
+
+MappedFile::MappedFile(const std::string &path):
+  data(nullptr),
+  size(0),
+  open(false),
+  error() {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    error = std::strerror(errno);
+    return;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    error = std::strerror(errno);
+    close(fd);
+    return;
+  }
+
+  size = info.st_size;
+  if (size > 0) {
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      error = std::strerror(errno);
+      size = 0;
+      close(fd);
+      return;
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = (const char *) mapping;
+  }
+
+  close(fd);
+  open = true;
+}
+
+MappedFile::~MappedFile() {
+  if (data) munmap((void *) data, size);
+}
+
+bool MappedFile::is_open() const {
+  return open;
+}
+
+std::string MappedFile::get_error() const {
+  return error;
+}
+
+std::string_view MappedFile::get_view() const {
+  return std::string_view(data, size);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+class MappedFile {
+public:
+  MappedFile(const std::string &path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool is_open() const;
+  std::string get_error() const;
+  std::string_view get_view() const;
+
+private:
+  const char *data;
+  size_t size;
+  bool open;
+  std::string error;
+};
@@ -0,0 +1,309 @@
+#include <new>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/mman.h>
+
+#include "NodeHeap.h"
+
+// Free blocks stay poisoned under AddressSanitizer, so nodes used after
+// their last release are still caught; only the heap reads their links
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(address, size) ASAN_POISON_MEMORY_REGION(address, size)
+#define UNPOISON(address, size) ASAN_UNPOISON_MEMORY_REGION(address, size)
+#else
+#define POISON(address, size) ((void) (address), (void) (size))
+#define UNPOISON(address, size) ((void) (address), (void) (size))
+#endif
+
+NodeHeap::Tenured::Tenured():
+  previous(target) {
+  target = Old;
+}
+
+NodeHeap::Tenured::~Tenured() {
+  target = previous;
+}
+
+NodeHeap::Owner::~Owner() {
+  if (heap) park(heap);
+}
+
+void *NodeHeap::allocate(size_t size) {
+  size_t size_class = (size - 1) / granularity;
+  if (size_class >= size_classes) return ::operator new(size);
+
+  Heap *heap = NodeHeap::heap;
+  if (!heap) heap = adopt();
+  Bin &bin = heap->bins[target][size_class];
+  size_t bytes = (size_class + 1) * granularity;
+
+  void *block;
+  if (bin.free) {
+    UNPOISON(bin.free, bytes);
+    block = bin.free;
+    bin.free = bin.free->next;
+  }
+  else if ((size_t) (bin.end - bin.next) >= bytes) {
+    block = bin.next;
+    bin.next += bytes;
+    ++bin.current->carved;
+    UNPOISON(block, bytes);
+  }
+  else {
+    block = refill(heap, bin, size_class);
+  }
+  heap->used[target].store(heap->used[target].load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+  return block;
+}
+
+void NodeHeap::free(void *pointer, size_t size) {
+  size_t size_class = (size - 1) / granularity;
+  if (size_class >= size_classes) {
+    ::operator delete(pointer);
+    return;
+  }
+
+  Block *block = (Block *) pointer;
+  Slab *slab = (Slab *) ((uintptr_t) pointer & ~(slab_size - 1));
+  size_t bytes = (size_class + 1) * granularity;
+
+  // Blocks of another thread's heap are handed back to it, to be reused
+  // once it next runs short or collects
+  Heap *heap = NodeHeap::heap;
+  if (slab->owner != heap) {
+    POISON((char *) pointer + sizeof(Block), bytes - sizeof(Block));
+    Heap *owner = slab->owner;
+    Block *head = owner->remote.load(std::memory_order_relaxed);
+    do {
+      block->next = head;
+    } while (!owner->remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+    return;
+  }
+
+  Bin &bin = heap->bins[slab->generation][slab->size_class];
+  block->next = bin.free;
+  bin.free = block;
+  POISON(block, bytes);
+  heap->used[slab->generation].store(heap->used[slab->generation].load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+  heap->freed[slab->generation] += bytes;
+}
+
+void NodeHeap::collect() {
+  Heap *heap = NodeHeap::heap;
+  if (!heap) return;
+  take_remote(heap);
+
+  // A sweep walks every free block of its generation, so it waits until
+  // about as much has been freed since the last one, which keeps its cost
+  // in proportion to the frees that led to it
+  for (Generation generation : { Nursery, Old }) {
+    size_t used = heap->used[generation].load(std::memory_order_relaxed);
+    size_t unused = heap->slabs[generation] * slab_size - std::min(used, heap->slabs[generation] * slab_size);
+    if (heap->freed[generation] < min_collection or heap->freed[generation] < unused / 2) continue;
+
+    auto start = std::chrono::steady_clock::now();
+    sweep(heap, generation);
+    auto pause = std::chrono::steady_clock::now() - start;
+    record_pause(std::chrono::duration_cast<std::chrono::microseconds>(pause).count(), generation);
+  }
+}
+
+NodeHeap::Stats NodeHeap::stats() {
+  Stats stats;
+  {
+    std::lock_guard<std::mutex> guard(registry);
+    for (Heap *heap = heaps; heap; heap = heap->next) {
+      stats.heap_bytes += heap->mapped.load(std::memory_order_relaxed);
+      stats.nursery_bytes += heap->used[Nursery].load(std::memory_order_relaxed);
+      stats.old_bytes += heap->used[Old].load(std::memory_order_relaxed);
+    }
+  }
+  stats.minor_collections = minor_collections;
+  stats.major_collections = major_collections;
+  stats.pause_total_us = pause_total_us;
+  stats.pause_max_us = pause_max_us;
+  return stats;
+}
+
+NodeHeap::Heap *NodeHeap::adopt() {
+  Heap *heap;
+  {
+    std::lock_guard<std::mutex> guard(registry);
+    heap = parked;
+    if (heap) {
+      parked = heap->next_parked;
+    }
+    else {
+      heap = new Heap;
+      heap->next = heaps;
+      heaps = heap;
+    }
+  }
+  NodeHeap::heap = heap;
+  owner.heap = heap;
+  return heap;
+}
+
+void NodeHeap::park(Heap *heap) {
+  // What the thread freed is given back before another thread takes over;
+  // nodes it leaves behind are freed into the parked heap as remote frees
+  take_remote(heap);
+  sweep(heap, Nursery);
+  sweep(heap, Old);
+  NodeHeap::heap = nullptr;
+
+  std::lock_guard<std::mutex> guard(registry);
+  heap->next_parked = parked;
+  parked = heap;
+}
+
+void *NodeHeap::refill(Heap *heap, Bin &bin, size_t size_class) {
+  size_t bytes = (size_class + 1) * granularity;
+  take_remote(heap);
+  if (bin.free) {
+    UNPOISON(bin.free, bytes);
+    Block *block = bin.free;
+    bin.free = block->next;
+    return block;
+  }
+
+  Slab *slab = map_slab(heap);
+  slab->generation = target;
+  slab->size_class = size_class;
+  slab->carved = 1;
+  bin.slabs.push_back(slab);
+  ++heap->slabs[target];
+  bin.current = slab;
+  bin.next = (char *) slab + header_size + bytes;
+  bin.end = (char *) slab + header_size + (slab_size - header_size) / bytes * bytes;
+
+  void *block = (char *) slab + header_size;
+  UNPOISON(block, bytes);
+  return block;
+}
+
+void NodeHeap::take_remote(Heap *heap) {
+  Block *block = heap->remote.exchange(nullptr, std::memory_order_acquire);
+  while (block) {
+    Block *next = block->next;
+    Slab *slab = (Slab *) ((uintptr_t) block & ~(slab_size - 1));
+    size_t bytes = (slab->size_class + 1) * granularity;
+    Bin &bin = heap->bins[slab->generation][slab->size_class];
+    block->next = bin.free;
+    bin.free = block;
+    POISON(block, bytes);
+    heap->used[slab->generation].store(heap->used[slab->generation].load(std::memory_order_relaxed) - bytes, std::memory_order_relaxed);
+    heap->freed[slab->generation] += bytes;
+    block = next;
+  }
+}
+
+void NodeHeap::sweep(Heap *heap, Generation generation) {
+  for (Bin &bin : heap->bins[generation]) {
+    if (bin.slabs.empty()) continue;
+
+    // A slab whose every block is on the free list holds no node
+    for (Slab *slab : bin.slabs) slab->free = 0;
+    for (Block *block = bin.free; block;) {
+      ((Slab *) ((uintptr_t) block & ~(slab_size - 1)))->free++;
+      UNPOISON(block, sizeof(Block));
+      Block *next = block->next;
+      POISON(block, sizeof(Block));
+      block = next;
+    }
+    bool empty = false;
+    for (Slab *slab : bin.slabs) empty = empty or slab->free == slab->carved;
+    if (!empty) continue;
+
+    Block *head = nullptr, *tail = nullptr;
+    for (Block *block = bin.free; block;) {
+      Slab *slab = (Slab *) ((uintptr_t) block & ~(slab_size - 1));
+      UNPOISON(block, sizeof(Block));
+      Block *next = block->next;
+      if (slab->free != slab->carved) {
+        block->next = nullptr;
+        if (tail) {
+          UNPOISON(tail, sizeof(Block));
+          tail->next = block;
+          POISON(tail, sizeof(Block));
+        }
+        else {
+          head = block;
+        }
+        tail = block;
+      }
+      POISON(block, sizeof(Block));
+      block = next;
+    }
+    bin.free = head;
+
+    // The slab being carved is kept, and carved again from its start
+    size_t kept = 0;
+    for (Slab *slab : bin.slabs) {
+      if (slab == bin.current and slab->free == slab->carved) {
+        slab->carved = 0;
+        bin.next = (char *) slab + header_size;
+      }
+      if (slab == bin.current or slab->free != slab->carved) {
+        bin.slabs[kept++] = slab;
+        continue;
+      }
+      --heap->slabs[generation];
+      unmap_slab(heap, slab);
+    }
+    bin.slabs.resize(kept);
+  }
+  heap->freed[generation] = 0;
+}
+
+NodeHeap::Slab *NodeHeap::map_slab(Heap *heap) {
+  if (!heap->empty.empty()) {
+    Slab *slab = heap->empty.back();
+    heap->empty.pop_back();
+    return slab;
+  }
+
+  // Mapped twice as large, so that an aligned slab fits, and trimmed
+  char *mapping = (char *) mmap(nullptr, 2 * slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) throw std::bad_alloc();
+  char *start = (char *) (((uintptr_t) mapping + slab_size - 1) & ~(slab_size - 1));
+  if (start > mapping) munmap(mapping, start - mapping);
+  munmap(start + slab_size, mapping + slab_size - start);
+
+  Slab *slab = (Slab *) start;
+  slab->owner = heap;
+  heap->mapped.store(heap->mapped.load(std::memory_order_relaxed) + slab_size, std::memory_order_relaxed);
+  return slab;
+}
+
+void NodeHeap::unmap_slab(Heap *heap, Slab *slab) {
+  if (heap->empty.size() < kept_slabs) {
+    POISON((char *) slab + header_size, slab_size - header_size);
+    heap->empty.push_back(slab);
+    return;
+  }
+  munmap(slab, slab_size);
+  heap->mapped.store(heap->mapped.load(std::memory_order_relaxed) - slab_size, std::memory_order_relaxed);
+}
+
+void NodeHeap::record_pause(uint64_t microseconds, Generation generation) {
+  ++(generation == Nursery ? minor_collections : major_collections);
+  pause_total_us += microseconds;
+  uint64_t longest = pause_max_us.load(std::memory_order_relaxed);
+  while (microseconds > longest and !pause_max_us.compare_exchange_weak(longest, microseconds));
+}
+
+thread_local NodeHeap::Heap *NodeHeap::heap = nullptr;
+thread_local NodeHeap::Generation NodeHeap::target = NodeHeap::Nursery;
+thread_local NodeHeap::Owner NodeHeap::owner;
+
+std::mutex NodeHeap::registry;
+NodeHeap::Heap *NodeHeap::heaps = nullptr;
+NodeHeap::Heap *NodeHeap::parked = nullptr;
+
+std::atomic<size_t> NodeHeap::minor_collections;
+std::atomic<size_t> NodeHeap::major_collections;
+std::atomic<uint64_t> NodeHeap::pause_total_us;
+std::atomic<uint64_t> NodeHeap::pause_max_us;
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Memory for the nodes of terms. Nodes are still freed by their reference
+// counts, which are exact as terms never form cycles; the heap decides where
+// they live and gives memory back once whole slabs of it are free.
+//
+// Every thread allocates from a heap of its own, in slabs of 256 KB that
+// each hold blocks of one size. Nodes built while parsing and reducing go to
+// the nursery, and most of them die before the statement ends. Definitions
+// are built in the old generation instead, so the few nodes that outlive a
+// statement do not keep nursery slabs alive. Collections run between
+// statements: a minor one sweeps the nursery's free blocks and unmaps the
+// slabs that are entirely free, a major one does the same for the old
+// generation. Each runs only once enough has been freed since the last one.
+class NodeHeap {
+public:
+  enum Generation {
+    Nursery, Old
+  };
+
+  class Stats {
+  public:
+    // Mapped for slabs, in use in each generation, and the collections run
+    // so far with the time they took
+    size_t heap_bytes = 0;
+    size_t nursery_bytes = 0;
+    size_t old_bytes = 0;
+    size_t minor_collections = 0;
+    size_t major_collections = 0;
+    uint64_t pause_total_us = 0;
+    uint64_t pause_max_us = 0;
+  };
+
+  // While one exists, nodes built on its thread go to the old generation
+  class Tenured {
+  public:
+    Tenured();
+    ~Tenured();
+
+  private:
+    Generation previous;
+  };
+
+  static void *allocate(size_t size);
+  static void free(void *block, size_t size);
+  // Safe at any point, as only slabs with no node left are given back
+  static void collect();
+  static Stats stats();
+
+private:
+  NodeHeap() = default;
+
+  static const size_t slab_size = 256 << 10;
+  static const size_t header_size = 64;
+  // Blocks of 8 to 128 bytes, in steps of 8; larger nodes are left to new
+  static const size_t granularity = 8;
+  static const size_t size_classes = 16;
+  static const size_t min_collection = 4 << 20;
+  // Empty slabs kept mapped by each heap, for the next statement to reuse
+  static const size_t kept_slabs = 4;
+
+  class Block {
+  public:
+    Block *next;
+  };
+
+  class Heap;
+
+  // Blocks start after this header, at the start of a slab aligned to its
+  // size, so a block finds its slab from its address
+  class Slab {
+  public:
+    Heap *owner;
+    Generation generation;
+    uint32_t size_class;
+    // Blocks handed out since it was mapped or swept empty, and, while a
+    // sweep runs, how many of them are free
+    uint32_t carved;
+    uint32_t free;
+  };
+
+  class Bin {
+  public:
+    Block *free = nullptr;
+    Slab *current = nullptr;
+    char *next = nullptr;
+    char *end = nullptr;
+    std::vector<Slab *> slabs;
+  };
+
+  class Heap {
+  public:
+    Bin bins[2][size_classes];
+    // Blocks freed by other threads, taken back by the owner
+    std::atomic<Block *> remote { nullptr };
+    std::vector<Slab *> empty;
+    // Written only by the owner, read by stats from any thread
+    std::atomic<size_t> used[2] { { 0 }, { 0 } };
+    std::atomic<size_t> mapped { 0 };
+    // Slabs of each generation, and what was freed since its last sweep
+    size_t slabs[2] = { 0, 0 };
+    size_t freed[2] = { 0, 0 };
+    Heap *next = nullptr;
+    Heap *next_parked = nullptr;
+  };
+
+  // Parks the thread's heap when it exits, for the next thread to adopt
+  class Owner {
+  public:
+    Heap *heap = nullptr;
+    ~Owner();
+  };
+
+  static Heap *adopt();
+  static void park(Heap *heap);
+  static void *refill(Heap *heap, Bin &bin, size_t size_class);
+  static void take_remote(Heap *heap);
+  static void sweep(Heap *heap, Generation generation);
+  static Slab *map_slab(Heap *heap);
+  static void unmap_slab(Heap *heap, Slab *slab);
+  static void record_pause(uint64_t microseconds, Generation generation);
+
+  static thread_local Heap *heap;
+  // Where the thread's new nodes go
+  static thread_local Generation target;
+  static thread_local Owner owner;
+
+  static std::mutex registry;
+  static Heap *heaps;
+  static Heap *parked;
+
+  static std::atomic<size_t> minor_collections;
+  static std::atomic<size_t> major_collections;
+  static std::atomic<uint64_t> pause_total_us;
+  static std::atomic<uint64_t> pause_max_us;
+};
@@ -2,168 +2,123 @@
 
 #include "Parser.h"
 
-AST::Node *Parser::parse(const std::string expression) {
+AST::Node *Parser::parse(std::string_view expression) {
   Parser::expression = expression;
-  position = 0;
-  stack_trace = StackTrace();
-  bind_levels = std::map<std::string, int>();
-  bind_count = 0;
   try {
-    stack_trace.push("parse", get_position());
-    AST::Node *node = parse_assignment();
-
-    if (position < expression.length())
-      throw TokenException("Invalid element", position, expression.length() - position);
-    stack_trace.pop();
-    return node;
+    tokens = Lexer::tokenize(expression);
   }
   catch (const ParserException &exception) {
+    stack_trace = StackTrace();
     print_error(exception);
     return nullptr;
   }
-}
 
-std::string Parser::get_expression() {
-  return expression;
-}
+  try {
+    return parse_tokens(false);
+  }
+  catch (const ParserException &) {
+    //
+  }
 
-char Parser::seek() {
-  if (position == expression.size()) {
-    return EOF;
+  // The stack trace is only needed for diagnostics, so the failing input is
+  // parsed a second time with tracing enabled.
+  try {
+    parse_tokens(true);
+    throw RuntimeException("Parser failed inconsistently", 0, expression.length());
   }
-  else {
-    return expression[position];
+  catch (const ParserException &exception) {
+    print_error(exception);
+    return nullptr;
   }
 }
 
-void Parser::next() {
-  if (position != expression.size()) {
-    ++position;
-  }
+AST::Node *Parser::parse_tokens(bool tracing) {
+  current = 0;
+  stack_trace = StackTrace();
+  Parser::tracing = tracing;
+  bind_levels = std::map<std::string_view, int>();
+  bind_count = 0;
+  nesting = 0;
+
+  trace("parse", 0);
+  AST::Node *node = parse_assignment();
+
+  if (seek().kind != Token::Kind::End)
+    throw TokenException("Invalid element", get_position(), expression.length() - get_position());
+  untrace();
+  return node;
 }
 
-size_t Parser::get_position() {
-  return position;
+std::string_view Parser::get_expression() {
+  return expression;
 }
 
-void Parser::set_position(size_t position) {
-  Parser::position = position;
+void Parser::set_arithmetic(bool arithmetic) {
+  Parser::arithmetic = arithmetic;
 }
 
-std::string Parser::expression;
-size_t Parser::position;
+const Token &Parser::seek(size_t lookahead) {
+  if (current + lookahead >= tokens.size()) {
+    return tokens.back();
+  }
+  else {
+    return tokens[current + lookahead];
+  }
+}
 
-void Parser::skip_space() {
-  char next_char = seek();
-  while (next_char == ' '
-    or next_char == '\t'
-    or next_char == '\n'
-    or next_char == '\r') {
-    next();
-    next_char = seek();
+void Parser::next() {
+  if (tokens[current].kind != Token::Kind::End) {
+    ++current;
   }
 }
 
-static bool is_alpha(char c) {
-  if (c == EOF) return false;
-  return (c >= 'a' and c <= 'z')
-    or (c >= 'A' and c <= 'Z')
-    or (c >= '0' and c <= '9')
-    or c == '_';
+size_t Parser::get_position() {
+  return seek().position;
 }
 
-static bool is_digit(char c) {
-  return c >= '0' and c <= '9';
+size_t Parser::get_end_position() {
+  if (current == 0) return 0;
+  const Token &last = tokens[current - 1];
+  return last.position + last.length;
 }
 
-std::string Parser::parse_name_token() {
-  stack_trace.push("parse_name_token", get_position());
+thread_local std::string_view Parser::expression;
+thread_local std::vector<Token> Parser::tokens;
+thread_local size_t Parser::current;
 
-  bool has_letters = false;
-  bool is_name = false;
-  skip_space();
-  size_t start = get_position();
+std::string_view Parser::parse_name_token() {
+  const Token &token = seek();
 
-  while (is_alpha(seek())) {
-    is_name = true;
-    if (!is_digit(seek())) has_letters = true;
+  if (token.kind == Token::Kind::Name) {
     next();
+    return expression.substr(token.position, token.length);
   }
-
-  if (has_letters) {
-    stack_trace.pop();
-    return expression.substr(start, get_position() - start);
-  }
-  else if (!is_name) {
-    set_position(start);
-    stack_trace.pop();
-    return "";
+  else if (token.kind == Token::Kind::Number) {
+    trace("parse_name_token", token.position);
+    throw TokenException("Invalid name", token.position, token.length);
   }
   else {
-    throw TokenException("Invalid name", start, get_position() - start);
-  }
-}
-
-std::string Parser::parse_number_token() {
-  stack_trace.push("parse_number_token", get_position());
-
-  skip_space();
-  size_t start = get_position();
-  while (is_digit(seek())) {
-    //char next_char = seek();
-    //number = number * 10 + next_char - '0';
-    next();
+    return std::string_view();
   }
-
-  if (is_alpha(seek())) {
-    throw TokenException("Invalid name", start, get_position() - start + 1);
-    //set_position(start);
-    //stack_trace.pop();
-    //return nullptr;
-  }
-
-  stack_trace.pop();
-  return expression.substr(start, get_position() - start);
-}
-
-std::string Parser::parse_symbol_token() {
-  std::string symbol;
-  skip_space();
-  switch (seek()) {
-  case '=': // Assign
-  case '.': // Dot
-  case '\\':// Lambda
-  case '(': // Opening_p
-  case ')': // Closing_p
-  case '+': // Plus
-  case '-': // Minus
-  case '*': // Times
-  case '/': // Divided
-    symbol = expression.substr(position, 1);
-    next();
-    return symbol;
-  default:
-    return "";
-  };
 }
 
 AST::Node *Parser::parse_abstraction_chain() {
-  stack_trace.push("parse_abstraction_chain", get_position());
-  skip_space();
+  trace("parse_abstraction_chain", get_position());
   size_t start = get_position();
 
-  if (parse_symbol_token() == ".") {
+  if (seek().kind == Token::Kind::Dot) {
+    next();
     AST::Node *term = parse_application_chain();
 
-    stack_trace.pop();
+    untrace();
     return term;
   }
 
-  std::string name = parse_name_token();
-  if (name != "") {
+  std::string_view name = parse_name_token();
+  if (!name.empty()) {
     AST::Node *abstraction = create_binding(name, start);
 
-    stack_trace.pop();
+    untrace();
     return abstraction;
   }
 
@@ -171,96 +126,122 @@ AST::Node *Parser::parse_abstraction_chain() {
 }
 
 AST::Node *Parser::parse_abstraction() {
-  stack_trace.push("parse_abstraction", get_position());
-  skip_space();
+  trace("parse_abstraction", get_position());
   size_t start = get_position();
 
-  if (parse_symbol_token() != "\\") {
+  if (seek().kind != Token::Kind::Lambda) {
     throw ParsingException("Not an abstraction", get_position());
   }
+  next();
 
-  std::string name = parse_name_token();
-  if (name == "") {
+  std::string_view name = parse_name_token();
+  if (name.empty()) {
     throw ParsingException("Not an abstraction", get_position());
   }
 
   AST::Node *abstraction = create_binding(name, start);
 
-  stack_trace.pop();
+  untrace();
   return abstraction;
 }
 
 AST::Node *Parser::parse_parenthesised() {
-  stack_trace.push("parse_parenthesised", get_position());
+  trace("parse_parenthesised", get_position());
 
-  if (parse_symbol_token() != "(") {
+  if (seek().kind != Token::Kind::Opening_p) {
     throw ParsingException("Not a parenthesised term", get_position());
   }
+  if (++nesting > max_nesting) {
+    throw ParsingException("Nested too deep", get_position());
+  }
+  next();
 
   AST::Node *term = parse_application_chain();
 
-  if (parse_symbol_token() != ")") {
+  if (seek().kind != Token::Kind::Closing_p) {
     throw ParsingException("Missing closing parenthesis", get_position());
   }
+  next();
+  --nesting;
 
-  stack_trace.pop();
+  untrace();
   return term;
 }
 
 AST::Node *Parser::parse_variable() {
-  stack_trace.push("parse_variable", get_position());
-  skip_space();
+  trace("parse_variable", get_position());
   size_t start = get_position();
 
-  std::string name = parse_name_token();
-  if (name != "") {
-    AST::Node *variable = create_variable(name, start, get_position() - start);
+  std::string_view name = parse_name_token();
+  if (!name.empty()) {
+    AST::Node *variable = create_variable(name, start, get_end_position() - start);
 
-    stack_trace.pop();
+    untrace();
     return variable;
   }
   else {
-    stack_trace.pop();
+    untrace();
     return nullptr;
   }
 }
 
-AST::Node *Parser::parse_term() {
-  stack_trace.push("parse_term", get_position());
-  skip_space();
-  size_t start = get_position();
+AST::Node *Parser::parse_number() {
+  trace("parse_number", get_position());
+  const Token &token = seek();
 
-  {
-    std::string symbol = parse_symbol_token();
-    set_position(start);
-    if (symbol == "\\") {
-      AST::Node *abstraction = parse_abstraction();
-      stack_trace.pop();
-      return abstraction;
-    }
-    else if (symbol == "(") {
-      AST::Node *parenthesised = parse_parenthesised();
-      stack_trace.pop();
-      return parenthesised;
-    }
+  long long value = 0;
+  for (char c : expression.substr(token.position, token.length)) {
+    if (__builtin_mul_overflow(value, 10, &value) or __builtin_add_overflow(value, c - '0', &value))
+      throw TokenException("Number too large", token.position, token.length);
   }
-  {
-    std::string name = parse_name_token();
-    set_position(start);
-    if (name != "") {
-      AST::Node *variable = parse_variable();
-      stack_trace.pop();
-      return variable;
-    }
+  next();
+
+  untrace();
+  return new AST::Number(value, token.position, token.length);
+}
+
+AST::Node *Parser::parse_operator() {
+  trace("parse_operator", get_position());
+  const Token &token = seek();
+  next();
+
+  untrace();
+  return new AST::Operator(expression[token.position], token.position, token.length);
+}
+
+AST::Node *Parser::parse_term() {
+  trace("parse_term", get_position());
+  AST::Node *term;
+
+  switch (seek().kind) {
+  case Token::Kind::Lambda:
+    term = parse_abstraction();
+    break;
+  case Token::Kind::Opening_p:
+    term = parse_parenthesised();
+    break;
+  case Token::Kind::Number:
+    term = arithmetic ? parse_number() : parse_variable();
+    break;
+  case Token::Kind::Name:
+    term = parse_variable();
+    break;
+  case Token::Kind::Plus:
+  case Token::Kind::Minus:
+  case Token::Kind::Times:
+  case Token::Kind::Divided:
+    term = arithmetic ? parse_operator() : nullptr;
+    break;
+  default:
+    term = nullptr;
   }
 
-  stack_trace.pop();
-  return nullptr;
+  untrace();
+  return term;
 }
 
 AST::Node *Parser::parse_application_chain() {
-  stack_trace.push("parse_application_chain", get_position());
-  skip_space();
+  trace("parse_application_chain", get_position());
   size_t start = get_position();
 
   AST::Node *term = parse_term();
@@ -272,49 +253,50 @@ AST::Node *Parser::parse_application_chain() {
     AST::Node *next_term = parse_term();
     if (!next_term) break;
 
-    term = new AST::Application(term, next_term, start, get_position() - start);
+    term = new AST::Application(term, next_term, start, get_end_position() - start);
   }
 
-  stack_trace.pop();
+  untrace();
   return term;
 }
 
 AST::Node *Parser::parse_assignment() {
-  stack_trace.push("parse_assignment", get_position());
-  skip_space();
+  trace("parse_assignment", get_position());
   size_t start = get_position();
 
-  std::string name = parse_name_token();
-  if (name == "") {
-    set_position(start);
-    return parse_application_chain();
-  }
+  if (seek().kind != Token::Kind::Name or seek(1).kind != Token::Kind::Assign) {
+    AST::Node *term = parse_application_chain();
 
-  if (parse_symbol_token() != "=") {
-    //throw ParsingException("Not an assignment", get_position());
-    set_position(start);
-    return parse_application_chain();
+    untrace();
+    return term;
   }
 
+  std::string_view name = parse_name_token();
+  next();
+
   AST::Node *term = parse_application_chain();
 
-  stack_trace.pop();
-  return new AST::Assignment(name, term, start, get_position() - start);
+  untrace();
+  return new AST::Assignment(Symbols::intern(name), term, start, get_end_position() - start);
 }
 
-AST::Abstraction *Parser::create_binding(std::string name, size_t start) {
+AST::Abstraction *Parser::create_binding(std::string_view name, size_t start) {
+  if (++nesting > max_nesting) {
+    throw ParsingException("Nested too deep", start);
+  }
+
   auto entry = bind_levels.find(name);
   if (entry == bind_levels.end()) {
-    bind_levels.insert(std::make_pair(name, bind_count));
+    entry = bind_levels.insert(std::make_pair(name, bind_count)).first;
     ++bind_count;
 
     AST::Node *term = parse_abstraction_chain();
-    get_position();
 
     --bind_count;
-    bind_levels.erase(name);
+    --nesting;
+    bind_levels.erase(entry);
 
-    return new AST::Abstraction(name, term, start, get_position() - start);
+    return new AST::Abstraction(Symbols::intern(name), term, start, get_end_position() - start);
   }
   else {
     int level = entry->second;
@@ -323,17 +305,18 @@ AST::Abstraction *Parser::create_binding(std::string name, size_t start) {
     AST::Node *term = parse_abstraction_chain();
 
     --bind_count;
+    --nesting;
     entry->second = level;
 
-    return new AST::Abstraction(name, term, start, get_position() - start, level);
+    return new AST::Abstraction(Symbols::intern(name), term, start, get_end_position() - start, level);
   }
 
 }
 
-AST::Node *Parser::create_variable(std::string name, size_t start, size_t length) {
+AST::Node *Parser::create_variable(std::string_view name, size_t start, size_t length) {
   auto entry = bind_levels.find(name);
   if (entry == bind_levels.end()) {
-    return new AST::Constant(name, start, length);
+    return new AST::Constant(Symbols::intern(name), start, length);
   }
   else {
     int level = entry->second;
@@ -341,13 +324,26 @@ AST::Node *Parser::create_variable(std::string name, size_t start, size_t length
   }
 }
 
-StackTrace Parser::stack_trace;
+void Parser::trace(const char *function, size_t position) {
+  if (tracing) stack_trace.push(function, position);
+}
 
-std::map<std::string, int> Parser::bind_levels;
-int Parser::bind_count;
+void Parser::untrace() {
+  if (tracing) stack_trace.pop();
+}
+
+thread_local StackTrace Parser::stack_trace;
+thread_local bool Parser::tracing;
+
+thread_local std::map<std::string_view, int> Parser::bind_levels;
+thread_local int Parser::bind_count;
+bool Parser::arithmetic = false;
+thread_local size_t Parser::nesting;
+size_t Parser::max_nesting = 10000;
+size_t Parser::max_trace = 32;
 
 void Parser::print_error(const ParserException &exception) {
-  expression += " ";
+  std::string expression = std::string(Parser::expression) + " ";
 
   size_t position = exception.get_position(), length = exception.get_length();
   /*if (position >= expression.length())
@@ -355,22 +351,28 @@ void Parser::print_error(const ParserException &exception) {
   if (position + length >= expression.length())
     length = expression.length() - position;
 
-  std::cout << "\n" << exception.get_name() << "! " << exception.get_message() << " at " << position << ".\n"
+  AST::get_output() << "\n" << exception.get_name() << "! " << exception.get_message() << " at " << position << ".\n"
     << "\033[31m" << expression.substr(0, position)
     << "\033[37;41m" << expression.substr(position, length)
     << "\033[0;31m" << expression.substr(position + length)
     << "\033[m\n";
 
-  while (!stack_trace.empty()) {
+  // Each call repeats the whole expression, so deeply nested input only
+  // shows the innermost ones
+  for (size_t shown = 0; !stack_trace.empty(); ++shown) {
+    if (shown == max_trace) {
+      AST::get_output() << "- ...\n";
+      break;
+    }
     StackEntry entry = stack_trace.top();
     size_t position = entry.position;
 
-    std::cout << "- At function \"" + entry.function + "\"\n"
+    AST::get_output() << "- At function \"" << entry.function << "\"\n"
       << "\033[41;37m" << expression.substr(0, position)
       << "\033[40;31m" << expression.substr(position)
       << "\033[m\n";
 
-    stack_trace.pop();
+    untrace();
   }
 }
 
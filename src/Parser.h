@@ -1,55 +1,69 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <vector>
 
 #include "ParserExceptions.h"
+#include "Lexer.h"
 #include "AST.h"
 
 class Parser {
 public:
-  static AST::Node *parse(const std::string expression);
-  static std::string get_expression();
+  static AST::Node *parse(std::string_view expression);
+  static std::string_view get_expression();
+  static void set_arithmetic(bool arithmetic);
 
 private:
   Parser() = default;
 
-  // STRING
+  // TOKENS
 
-  static char seek();
+  static const Token &seek(size_t lookahead = 0);
   static void next();
   static size_t get_position();
-  static void set_position(size_t position);
-
-  static std::string expression;
-  static size_t position;
+  static size_t get_end_position();
 
-  // TOKENS
+  static thread_local std::string_view expression;
+  static thread_local std::vector<Token> tokens;
+  static thread_local size_t current;
 
-  static void skip_space();
-  static std::string parse_name_token();
-  static std::string parse_number_token();
-  static std::string parse_symbol_token();
+  static std::string_view parse_name_token();
 
   // PARSING
 
+  static AST::Node *parse_tokens(bool tracing);
+
   static AST::Node *parse_abstraction_chain();
   static AST::Node *parse_abstraction();
   static AST::Node *parse_parenthesised();
   static AST::Node *parse_variable();
+  static AST::Node *parse_number();
+  static AST::Node *parse_operator();
   static AST::Node *parse_term();
   static AST::Node *parse_application_chain();
   static AST::Node *parse_assignment();
 
-  static AST::Abstraction *create_binding(std::string name, size_t start);
-  static AST::Node *create_variable(std::string name, size_t start, size_t length);
+  static AST::Abstraction *create_binding(std::string_view name, size_t start);
+  static AST::Node *create_variable(std::string_view name, size_t start, size_t length);
 
   // REDUCING
 
-  static StackTrace stack_trace;
+  static void trace(const char *function, size_t position);
+  static void untrace();
+
+  static thread_local StackTrace stack_trace;
+  static thread_local bool tracing;
 
-  static std::map<std::string, int> bind_levels;
-  static int bind_count;
+  static thread_local std::map<std::string_view, int> bind_levels;
+  static thread_local int bind_count;
+  static bool arithmetic;
+  // Parentheses and binders nest one call each, so input nested deeper than
+  // this is reported rather than overflowing the stack
+  static thread_local size_t nesting;
+  static size_t max_nesting;
+  static size_t max_trace;
 
   static void print_error(const ParserException &exception);
 };
\ No newline at end of file
@@ -46,12 +46,12 @@ std::string RuntimeException::get_name() const {
   return "RuntimeException";
 }
 
-StackEntry::StackEntry(const std::string function, size_t position) :
+StackEntry::StackEntry(const char *function, size_t position) :
   function(function),
   position(position) {
 }
 
-std::string StackEntry::get_function() const {
+const char *StackEntry::get_function() const {
   return function;
 }
 
@@ -64,7 +64,7 @@ StackTrace::StackTrace():
   //
 }
 
-void StackTrace::push(const std::string function, size_t position) {
+void StackTrace::push(const char *function, size_t position) {
   //std::cout << "Entered function \"" + function + "\".\n";
   stack.push(StackEntry(function, position));
 }
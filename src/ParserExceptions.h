@@ -51,12 +51,12 @@ public:
 
 class StackEntry {
 public:
-  StackEntry(const std::string function, size_t position);
+  StackEntry(const char *function, size_t position);
 
-  std::string get_function() const;
+  const char *get_function() const;
   size_t get_position() const;
 
-  const std::string function;
+  const char *function;
   size_t position;
 };
 
@@ -64,7 +64,7 @@ class StackTrace {
 public:
   StackTrace();
 
-  void push(const std::string function, size_t position);
+  void push(const char *function, size_t position);
   void pop();
   bool empty() const;
   StackEntry top() const;
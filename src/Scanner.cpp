@@ -0,0 +1,203 @@
+#include "Scanner.h"
+
+#if defined(__x86_64__) or defined(__i386__)
+#define SCANNER_X86
+#include <immintrin.h>
+#endif
+
+const char *Scanner::skip_space(const char *ptr, const char *end) {
+  if (ptr == end or !is_space(*ptr)) return ptr;
+  return space_scanner(ptr, end);
+}
+
+const char *Scanner::skip_name(const char *ptr, const char *end, bool &has_letters) {
+  return name_scanner(ptr, end, has_letters);
+}
+
+Scanner::Implementation Scanner::get_implementation() {
+  return implementation;
+}
+
+bool Scanner::set_implementation(Implementation implementation) {
+  if (!is_supported(implementation)) return false;
+
+  switch (implementation) {
+#ifdef SCANNER_X86
+  case Implementation::AVX2:
+    space_scanner = skip_space_avx2;
+    name_scanner = skip_name_avx2;
+    break;
+  case Implementation::SSE2:
+    space_scanner = skip_space_sse2;
+    name_scanner = skip_name_sse2;
+    break;
+#endif
+  default:
+    space_scanner = skip_space_scalar;
+    name_scanner = skip_name_scalar;
+  }
+  Scanner::implementation = implementation;
+  return true;
+}
+
+bool Scanner::is_supported(Implementation implementation) {
+  switch (implementation) {
+#ifdef SCANNER_X86
+  case Implementation::AVX2:
+    return __builtin_cpu_supports("avx2");
+  case Implementation::SSE2:
+    return __builtin_cpu_supports("sse2");
+#endif
+  case Implementation::Scalar:
+    return true;
+  default:
+    return false;
+  }
+}
+
+std::string Scanner::get_implementation_string(Implementation implementation) {
+  static char const *const names[] {
+    "scalar", "sse2", "avx2",
+  };
+  return std::string { names[static_cast<int>(implementation)] };
+}
+
+bool Scanner::is_space(char c) {
+  return c == ' ' or c == '\t' or c == '\n' or c == '\r';
+}
+
+bool Scanner::is_alpha(char c) {
+  return (c >= 'a' and c <= 'z')
+    or (c >= 'A' and c <= 'Z')
+    or (c >= '0' and c <= '9')
+    or c == '_';
+}
+
+bool Scanner::is_digit(char c) {
+  return c >= '0' and c <= '9';
+}
+
+const char *Scanner::skip_space_scalar(const char *ptr, const char *end) {
+  while (ptr != end and is_space(*ptr)) ++ptr;
+  return ptr;
+}
+
+const char *Scanner::skip_name_scalar(const char *ptr, const char *end, bool &has_letters) {
+  while (ptr != end and is_alpha(*ptr)) {
+    if (!is_digit(*ptr)) has_letters = true;
+    ++ptr;
+  }
+  return ptr;
+}
+
+#ifdef SCANNER_X86
+
+// Each block is classified into a bit mask (one bit per byte) and the scan
+// stops at the first byte outside the class. Bytes >= 0x80 compare as negative
+// and therefore never fall inside the ASCII ranges.
+
+const char *Scanner::skip_space_sse2(const char *ptr, const char *end) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i carriage = _mm_set1_epi8('\r');
+
+  while (end - ptr >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) ptr);
+    __m128i matches = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, tab)),
+      _mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, carriage)));
+    unsigned mask = ~_mm_movemask_epi8(matches) & 0xFFFF;
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 16;
+  }
+  return skip_space_scalar(ptr, end);
+}
+
+const char *Scanner::skip_name_sse2(const char *ptr, const char *end, bool &has_letters) {
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i before_a = _mm_set1_epi8('a' - 1);
+  const __m128i after_z = _mm_set1_epi8('z' + 1);
+  const __m128i before_0 = _mm_set1_epi8('0' - 1);
+  const __m128i after_9 = _mm_set1_epi8('9' + 1);
+  const __m128i underscore = _mm_set1_epi8('_');
+
+  while (end - ptr >= 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) ptr);
+    __m128i lower = _mm_or_si128(block, case_bit);
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a), _mm_cmpgt_epi8(after_z, lower));
+    __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(block, before_0), _mm_cmpgt_epi8(after_9, block));
+    __m128i others = _mm_or_si128(letters, _mm_cmpeq_epi8(block, underscore));
+
+    unsigned name_mask = _mm_movemask_epi8(_mm_or_si128(others, digits));
+    unsigned stop = ~name_mask & 0xFFFF;
+    unsigned length_mask = stop ? (1u << __builtin_ctz(stop)) - 1 : 0xFFFF;
+    if (_mm_movemask_epi8(others) & length_mask) has_letters = true;
+
+    if (stop) return ptr + __builtin_ctz(stop);
+    ptr += 16;
+  }
+  return skip_name_scalar(ptr, end, has_letters);
+}
+
+__attribute__((target("avx2")))
+const char *Scanner::skip_space_avx2(const char *ptr, const char *end) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i carriage = _mm256_set1_epi8('\r');
+
+  while (end - ptr >= 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) ptr);
+    __m256i matches = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, tab)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, carriage)));
+    unsigned mask = ~(unsigned) _mm256_movemask_epi8(matches);
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 32;
+  }
+  return skip_space_sse2(ptr, end);
+}
+
+__attribute__((target("avx2")))
+const char *Scanner::skip_name_avx2(const char *ptr, const char *end, bool &has_letters) {
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  const __m256i before_a = _mm256_set1_epi8('a' - 1);
+  const __m256i after_z = _mm256_set1_epi8('z' + 1);
+  const __m256i before_0 = _mm256_set1_epi8('0' - 1);
+  const __m256i after_9 = _mm256_set1_epi8('9' + 1);
+  const __m256i underscore = _mm256_set1_epi8('_');
+
+  while (end - ptr >= 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) ptr);
+    __m256i lower = _mm256_or_si256(block, case_bit);
+    __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(lower, before_a), _mm256_cmpgt_epi8(after_z, lower));
+    __m256i digits = _mm256_and_si256(_mm256_cmpgt_epi8(block, before_0), _mm256_cmpgt_epi8(after_9, block));
+    __m256i others = _mm256_or_si256(letters, _mm256_cmpeq_epi8(block, underscore));
+
+    unsigned name_mask = _mm256_movemask_epi8(_mm256_or_si256(others, digits));
+    unsigned stop = ~name_mask;
+    unsigned length_mask = stop ? (1u << __builtin_ctz(stop)) - 1 : 0xFFFFFFFF;
+    if ((unsigned) _mm256_movemask_epi8(others) & length_mask) has_letters = true;
+
+    if (stop) return ptr + __builtin_ctz(stop);
+    ptr += 32;
+  }
+  return skip_name_sse2(ptr, end, has_letters);
+}
+
+#endif
+
+Scanner::Implementation Scanner::detect() {
+#ifdef SCANNER_X86
+  __builtin_cpu_init();
+#endif
+  if (set_implementation(Implementation::AVX2)) return Implementation::AVX2;
+  if (set_implementation(Implementation::SSE2)) return Implementation::SSE2;
+  set_implementation(Implementation::Scalar);
+  return Implementation::Scalar;
+}
+
+Scanner::SpaceScanner Scanner::space_scanner = Scanner::skip_space_scalar;
+Scanner::NameScanner Scanner::name_scanner = Scanner::skip_name_scalar;
+Scanner::Implementation Scanner::implementation = Scanner::detect();
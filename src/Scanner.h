@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+
+class Scanner {
+public:
+  enum class Implementation {
+    Scalar, SSE2, AVX2
+  };
+
+  static const char *skip_space(const char *ptr, const char *end);
+  static const char *skip_name(const char *ptr, const char *end, bool &has_letters);
+
+  static Implementation get_implementation();
+  static bool set_implementation(Implementation implementation);
+  static bool is_supported(Implementation implementation);
+  static std::string get_implementation_string(Implementation implementation);
+
+  static bool is_space(char c);
+  static bool is_alpha(char c);
+  static bool is_digit(char c);
+
+private:
+  Scanner() = default;
+
+  typedef const char *(*SpaceScanner)(const char *ptr, const char *end);
+  typedef const char *(*NameScanner)(const char *ptr, const char *end, bool &has_letters);
+
+  static const char *skip_space_scalar(const char *ptr, const char *end);
+  static const char *skip_name_scalar(const char *ptr, const char *end, bool &has_letters);
+  static const char *skip_space_sse2(const char *ptr, const char *end);
+  static const char *skip_name_sse2(const char *ptr, const char *end, bool &has_letters);
+  static const char *skip_space_avx2(const char *ptr, const char *end);
+  static const char *skip_name_avx2(const char *ptr, const char *end, bool &has_letters);
+
+  static Implementation detect();
+
+  static Implementation implementation;
+  static SpaceScanner space_scanner;
+  static NameScanner name_scanner;
+};
@@ -0,0 +1,299 @@
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "Server.h"
+#include "TypeChecker.h"
+#include "GraphReducer.h"
+#include "NodeHeap.h"
+#include "Parser.h"
+
+int Server::serve(const std::string &path, int workers) {
+  sockaddr_un address {};
+  if (path.size() >= sizeof(address.sun_path)) {
+    std::cout << "\nSocket path too long: \"" << path << "\"\n";
+    return 1;
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  // A socket left behind by an earlier server is replaced, anything else at
+  // that path is not
+  struct stat status;
+  if (stat(path.c_str(), &status) == 0 and S_ISSOCK(status.st_mode)) unlink(path.c_str());
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 or bind(listener, (sockaddr *) &address, sizeof(address)) < 0
+    or listen(listener, SOMAXCONN) < 0 or pipe(wakeup) < 0) {
+    std::cout << "\nCould not listen on \"" << path << "\": " << std::strerror(errno) << "\n";
+    return 1;
+  }
+  fcntl(wakeup[0], F_SETFL, O_NONBLOCK);
+  fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+
+  // Workers reduce terms as deep as the main thread does, so they get a
+  // stack of their own size rather than the platform default
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, worker_stack);
+  for (int i = 0; i < workers; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attributes, work, nullptr) != 0) {
+      std::cout << "\nCould not start worker " << i << "\n";
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+  pthread_attr_destroy(&attributes);
+
+  std::cout << "\nServing on \"" << path << "\" with " << workers << " workers\n" << std::flush;
+  poll_connections();
+  std::cout << "\nServer stopped: " << std::strerror(errno) << "\n";
+  return 1;
+}
+
+void Server::poll_connections() {
+  std::vector<Connection *> idle, waiting;
+  std::vector<pollfd> fds;
+
+  while (true) {
+    fds.clear();
+    fds.push_back({ wakeup[0], POLLIN, 0 });
+    fds.push_back({ listener, POLLIN, 0 });
+    for (Connection *connection : idle) {
+      fds.push_back({ connection->fd, POLLIN, 0 });
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    waiting.clear();
+    for (size_t i = 0; i < idle.size(); ++i) {
+      Connection *connection = idle[i];
+      if (!fds[i + 2].revents) {
+        waiting.push_back(connection);
+        continue;
+      }
+
+      char buffer[4096];
+      ssize_t count = read(connection->fd, buffer, sizeof(buffer));
+      if (count <= 0) {
+        close(connection->fd);
+        delete connection;
+        --connections;
+        continue;
+      }
+
+      connection->input.append(buffer, count);
+      if (connection->input.find('\n') == std::string::npos and connection->input.size() <= max_request) {
+        waiting.push_back(connection);
+        continue;
+      }
+
+      std::lock_guard<std::mutex> guard(queue_lock);
+      ready.push_back(connection);
+      queue_ready.notify_one();
+    }
+    idle.swap(waiting);
+
+    if (fds[0].revents) {
+      char buffer[64];
+      while (read(wakeup[0], buffer, sizeof(buffer)) > 0);
+
+      std::lock_guard<std::mutex> guard(queue_lock);
+      for (Connection *connection : finished) {
+        if (connection->closed) {
+          close(connection->fd);
+          delete connection;
+          --connections;
+        }
+        else {
+          idle.push_back(connection);
+        }
+      }
+      finished.clear();
+    }
+
+    if (fds[1].revents) {
+      int fd = accept(listener, nullptr, nullptr);
+      if (fd >= 0) {
+        idle.push_back(new Connection { fd, "", false });
+        ++connections;
+      }
+    }
+  }
+}
+
+void *Server::work(void *) {
+  AST::set_verbose(false);
+
+  while (true) {
+    Connection *connection;
+    {
+      std::unique_lock<std::mutex> guard(queue_lock);
+      queue_ready.wait(guard, [] { return !ready.empty(); });
+      connection = ready.front();
+      ready.pop_front();
+    }
+
+    // The dictionary loaded at startup is never written while serving, so
+    // sessions only need their own namespace
+    AST::set_namespace(&connection->names);
+    std::string response;
+    size_t start = 0, end;
+    while ((end = connection->input.find('\n', start)) != std::string::npos) {
+      response += handle(std::string_view(connection->input).substr(start, end - start)) + "\n";
+      start = end + 1;
+    }
+    connection->input.erase(0, start);
+    AST::set_namespace(nullptr);
+
+    if (connection->input.size() > max_request) {
+      response += "error Request too long\n";
+      connection->closed = true;
+    }
+    if (!send_all(connection->fd, response)) connection->closed = true;
+
+    {
+      std::lock_guard<std::mutex> guard(queue_lock);
+      finished.push_back(connection);
+    }
+    wake();
+  }
+  return nullptr;
+}
+
+void Server::wake() {
+  char byte = 0;
+  if (write(wakeup[1], &byte, 1) < 0) {
+    // The pipe is full, so the poller is already due to wake up
+  }
+}
+
+std::string Server::handle(std::string_view request) {
+  ++requests;
+  if (!request.empty() and request.back() == '\r') request.remove_suffix(1);
+
+  size_t space = request.find(' ');
+  std::string_view command = request.substr(0, space);
+  std::string_view argument = space == std::string_view::npos ? "" : request.substr(space + 1);
+
+  if (command == "eval") return evaluate(argument, false);
+  if (command == "define") return evaluate(argument, true);
+  if (command == "stats" and argument.empty()) return stats();
+
+  ++errors;
+  return "error Unknown command \"" + std::string(command) + "\"";
+}
+
+std::string Server::evaluate(std::string_view statement, bool definition) {
+  ++(definition ? definitions : evaluations);
+
+  std::ostringstream output;
+  AST::set_output(output);
+  std::string source(statement);
+  std::string result;
+
+  AST::Node *node = Parser::parse(source);
+  if (node and (node->get_type() == AST::Node::Type::Assignment) != definition) {
+    node->release();
+    AST::set_output(std::cout);
+    ++errors;
+    return definition ? "error Expected an assignment" : "error Assignments are sent with define";
+  }
+
+  if (node) {
+    result = AST::solve(node, source);
+    node->release();
+  }
+  AST::set_output(std::cout);
+  // Types and code kept for the next request could hold definitions from
+  // another session, which the worker that serves it next would share and
+  // release
+  TypeChecker::clear();
+  GraphReducer::clear();
+
+  // Errors are printed rather than returned; their first line names them
+  std::istringstream printed(strip_colours(output.str()));
+  std::string line;
+  while (std::getline(printed, line)) {
+    if (line.empty()) continue;
+    ++errors;
+    return "error " + line;
+  }
+
+  if (definition) return "ok";
+  return "ok " + strip_colours(result);
+}
+
+std::string Server::stats() {
+  NodeHeap::Stats heap = NodeHeap::stats();
+  return "ok connections=" + std::to_string(connections)
+    + " requests=" + std::to_string(requests)
+    + " evaluations=" + std::to_string(evaluations)
+    + " definitions=" + std::to_string(definitions)
+    + " errors=" + std::to_string(errors)
+    + " constants=" + std::to_string(AST::count_constants())
+    + " heap_kb=" + std::to_string(heap.heap_bytes >> 10)
+    + " nursery_kb=" + std::to_string(heap.nursery_bytes >> 10)
+    + " old_kb=" + std::to_string(heap.old_bytes >> 10)
+    + " minor_collections=" + std::to_string(heap.minor_collections)
+    + " major_collections=" + std::to_string(heap.major_collections)
+    + " pause_total_us=" + std::to_string(heap.pause_total_us)
+    + " pause_max_us=" + std::to_string(heap.pause_max_us);
+}
+
+std::string Server::strip_colours(std::string_view text) {
+  std::string result;
+  result.reserve(text.size());
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] != '\033' or i + 1 == text.size() or text[i + 1] != '[') {
+      result += text[i];
+      continue;
+    }
+    // Skip the parameters up to the final byte of the escape sequence
+    i += 2;
+    while (i < text.size() and (text[i] < '@' or text[i] > '~')) ++i;
+  }
+  return result;
+}
+
+bool Server::send_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t count = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data.remove_prefix(count);
+  }
+  return true;
+}
+
+int Server::listener = -1;
+int Server::wakeup[2] = { -1, -1 };
+size_t Server::worker_stack = 64 << 20;
+size_t Server::max_request = 1 << 20;
+
+std::mutex Server::queue_lock;
+std::condition_variable Server::queue_ready;
+std::deque<Server::Connection *> Server::ready;
+std::vector<Server::Connection *> Server::finished;
+
+std::atomic<size_t> Server::connections;
+std::atomic<size_t> Server::requests;
+std::atomic<size_t> Server::evaluations;
+std::atomic<size_t> Server::definitions;
+std::atomic<size_t> Server::errors;
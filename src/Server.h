@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "AST.h"
+
+// Serves the dictionary loaded at startup over a Unix domain socket. Every
+// connection is a session whose definitions only it can see. Each request
+// is one line and gets one line back, "ok <text>" or "error <text>":
+//
+//   define <name> = <expression>
+//   eval <expression>
+//   stats
+class Server {
+public:
+  static int serve(const std::string &path, int workers);
+
+private:
+  Server() = default;
+
+  class Connection {
+  public:
+    int fd;
+    std::string input;
+    bool closed;
+    AST::Namespace names;
+  };
+
+  // One thread waits on the socket and on every idle connection, and hands
+  // connections with complete requests to the worker pool
+  static void poll_connections();
+  static void *work(void *argument);
+  static void wake();
+
+  static std::string handle(std::string_view request);
+  static std::string evaluate(std::string_view statement, bool definition);
+  static std::string stats();
+  static std::string strip_colours(std::string_view text);
+  static bool send_all(int fd, std::string_view data);
+
+  static int listener;
+  static int wakeup[2];
+  static size_t worker_stack;
+  static size_t max_request;
+
+  static std::mutex queue_lock;
+  static std::condition_variable queue_ready;
+  static std::deque<Connection *> ready;
+  static std::vector<Connection *> finished;
+
+  static std::atomic<size_t> connections;
+  static std::atomic<size_t> requests;
+  static std::atomic<size_t> evaluations;
+  static std::atomic<size_t> definitions;
+  static std::atomic<size_t> errors;
+};
@@ -0,0 +1,51 @@
+#include <mutex>
+
+#include "Symbols.h"
+
+Symbols::Id Symbols::intern(std::string_view name) {
+  {
+    std::shared_lock<std::shared_mutex> reading(lock);
+    auto entry = ids.find(name);
+    if (entry != ids.end()) return entry->second;
+  }
+
+  std::unique_lock<std::shared_mutex> writing(lock);
+  auto entry = ids.find(name);
+  if (entry != ids.end()) return entry->second;
+
+  Id id = names.size();
+  names.emplace_back(name);
+  ids.insert({ names.back(), id });
+  return id;
+}
+
+const std::string &Symbols::get_name(Id id) {
+  std::shared_lock<std::shared_mutex> reading(lock);
+  return names[id];
+}
+
+Symbols::Id Symbols::rename(Id id, int count) {
+  uint64_t key = (uint64_t) id << 32 | (uint32_t) count;
+  std::string name;
+  {
+    std::shared_lock<std::shared_mutex> reading(lock);
+    auto entry = renames.find(key);
+    if (entry != renames.end()) return entry->second;
+    name = names[id] + "(" + std::to_string(count) + ")";
+  }
+
+  Id renamed = intern(name);
+  std::unique_lock<std::shared_mutex> writing(lock);
+  renames.insert({ key, renamed });
+  return renamed;
+}
+
+size_t Symbols::size() {
+  std::shared_lock<std::shared_mutex> reading(lock);
+  return names.size();
+}
+
+std::deque<std::string> Symbols::names;
+std::unordered_map<std::string_view, Symbols::Id> Symbols::ids;
+std::unordered_map<uint64_t, Symbols::Id> Symbols::renames;
+std::shared_mutex Symbols::lock;
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <shared_mutex>
+#include <cstdint>
+
+class Symbols {
+public:
+  typedef uint32_t Id;
+
+  static Id intern(std::string_view name);
+  static const std::string &get_name(Id id);
+  static Id rename(Id id, int count);
+  static size_t size();
+
+private:
+  Symbols() = default;
+
+  static std::deque<std::string> names;
+  static std::unordered_map<std::string_view, Id> ids;
+  static std::unordered_map<uint64_t, Id> renames;
+  // Names are interned by parsers on several threads. The deque never moves
+  // its strings, so a name stays valid after the lock is dropped
+  static std::shared_mutex lock;
+};
@@ -0,0 +1,560 @@
+#include <limits>
+#include <algorithm>
+
+#include "TermStore.h"
+
+AST::Node *TermStore::normalize(AST::Node *node) {
+  cells.clear();
+  spans.clear();
+  definitions.clear();
+  steps = 0;
+
+  try {
+    root = import(node);
+    spans.insert({ root, { node->position, node->length } });
+
+    Index result = normalize_term(root);
+    std::vector<Symbols::Id> scope;
+    AST::Node *output = export_term(result, scope);
+
+    cells.clear();
+    spans.clear();
+    definitions.clear();
+    tasks.clear();
+    results.clear();
+    return output;
+  }
+  catch (const ParserException &exception) {
+    cells.clear();
+    spans.clear();
+    definitions.clear();
+    tasks.clear();
+    results.clear();
+    throw;
+  }
+}
+
+TermStore::Index TermStore::make(Tag tag, uint32_t a, uint32_t b, uint32_t free, char symbol) {
+  if (cells.size() >= std::numeric_limits<Index>::max())
+    throw error("Term store is full", root);
+  cells.push_back({ tag, symbol, false, free, a, b });
+  return cells.size() - 1;
+}
+
+TermStore::Index TermStore::make_variable(uint32_t index) {
+  return make(Tag::Variable, index, 0, index);
+}
+
+TermStore::Index TermStore::make_abstraction(Index body, Symbols::Id name) {
+  uint32_t free = cells[body].free;
+  return make(Tag::Abstraction, body, name, free ? free - 1 : 0);
+}
+
+TermStore::Index TermStore::make_application(Index function, Index argument) {
+  uint32_t free = std::max(cells[function].free, cells[argument].free);
+  return make(Tag::Application, function, argument, free);
+}
+
+TermStore::Index TermStore::make_number(long long value) {
+  unsigned long long bits = value;
+  return make(Tag::Number, (uint32_t) bits, (uint32_t) (bits >> 32), 0);
+}
+
+long long TermStore::get_number(const Cell &cell) {
+  return (long long) ((unsigned long long) cell.b << 32 | cell.a);
+}
+
+TermStore::Index TermStore::import(AST::Node *node, bool source) {
+  // Terms can nest as deep as any numeral, so every traversal of the store
+  // keeps its pending work on a stack instead of recursing
+  class Pending {
+  public:
+    enum class Kind { Visit, Bind, Apply } kind;
+    AST::Node *node;
+  };
+  std::vector<Pending> pending { { Pending::Kind::Visit, node } };
+  std::vector<Index> terms;
+
+  while (!pending.empty()) {
+    Pending task = pending.back();
+    pending.pop_back();
+    node = task.node;
+
+    if (task.kind == Pending::Kind::Bind) {
+      terms.back() = make_abstraction(terms.back(), ((AST::Abstraction *) node)->name);
+      continue;
+    }
+    if (task.kind == Pending::Kind::Apply) {
+      Index argument = terms.back();
+      terms.pop_back();
+      terms.back() = make_application(terms.back(), argument);
+      continue;
+    }
+
+    Index term;
+    switch (node->get_type()) {
+    case AST::Node::Type::Variable:
+      terms.push_back(make_variable(((AST::Variable *) node)->bruijn_index));
+      continue;
+    case AST::Node::Type::Constant:
+      term = make(Tag::Constant, ((AST::Constant *) node)->name, 0, 0);
+      break;
+    case AST::Node::Type::Abstraction:
+      pending.push_back({ Pending::Kind::Bind, node });
+      pending.push_back({ Pending::Kind::Visit, ((AST::Abstraction *) node)->term });
+      continue;
+    case AST::Node::Type::Application:
+      pending.push_back({ Pending::Kind::Apply, node });
+      pending.push_back({ Pending::Kind::Visit, ((AST::Application *) node)->term2 });
+      pending.push_back({ Pending::Kind::Visit, ((AST::Application *) node)->term1 });
+      continue;
+    case AST::Node::Type::Number:
+      term = make_number(((AST::Number *) node)->value);
+      break;
+    case AST::Node::Type::Operator:
+      term = make(Tag::Operator, 0, 0, 0, ((AST::Operator *) node)->symbol);
+      break;
+    default:
+      throw RuntimeException("Invalid operation on assignment", node->position, node->length);
+    }
+
+    if (source) spans.insert({ term, { node->position, node->length } });
+    terms.push_back(term);
+  }
+
+  return terms.back();
+}
+
+AST::Node *TermStore::export_term(Index term, std::vector<Symbols::Id> &scope) {
+  auto [position, length] = spans.at(root);
+  class Pending {
+  public:
+    enum class Kind { Visit, Bind, Apply } kind;
+    Index term;
+    Symbols::Id name;
+  };
+  std::vector<Pending> pending { { Pending::Kind::Visit, term, 0 } };
+  std::vector<AST::Node *> nodes;
+
+  while (!pending.empty()) {
+    Pending task = pending.back();
+    pending.pop_back();
+
+    if (task.kind == Pending::Kind::Bind) {
+      scope.pop_back();
+      nodes.back() = new AST::Abstraction(task.name, nodes.back(), position, length);
+      continue;
+    }
+    if (task.kind == Pending::Kind::Apply) {
+      AST::Node *argument = nodes.back();
+      nodes.pop_back();
+      nodes.back() = new AST::Application(nodes.back(), argument, position, length);
+      continue;
+    }
+
+    Cell cell = cells[task.term];
+    switch (cell.tag) {
+    case Tag::Variable:
+      nodes.push_back(new AST::Variable(cell.a, position, length));
+      continue;
+    case Tag::Constant:
+      nodes.push_back(new AST::Constant(cell.a, position, length));
+      continue;
+    case Tag::Number:
+      nodes.push_back(new AST::Number(get_number(cell), position, length));
+      continue;
+    case Tag::Operator:
+      nodes.push_back(new AST::Operator(cell.symbol, position, length));
+      continue;
+    case Tag::Application:
+      pending.push_back({ Pending::Kind::Apply, task.term, 0 });
+      pending.push_back({ Pending::Kind::Visit, cell.b, 0 });
+      pending.push_back({ Pending::Kind::Visit, cell.a, 0 });
+      continue;
+    default:
+      break;
+    }
+
+    // Rename the binder if it would hide an outer binder of the same name
+    // that the body still refers to
+    Symbols::Id name = cell.b;
+    std::set<uint32_t> indexes;
+    collect_free(cell.a, 1, indexes);
+    for (int count = 2; ; ++count) {
+      bool hidden = false;
+      for (uint32_t index : indexes) {
+        if (index <= scope.size() and scope[scope.size() - index] == name) hidden = true;
+      }
+      if (!hidden) break;
+      name = Symbols::rename(cell.b, count);
+    }
+
+    scope.push_back(name);
+    pending.push_back({ Pending::Kind::Bind, task.term, name });
+    pending.push_back({ Pending::Kind::Visit, cell.a, 0 });
+  }
+
+  return nodes.back();
+}
+
+void TermStore::collect_free(Index term, uint32_t depth, std::set<uint32_t> &indexes) {
+  std::vector<std::pair<Index, uint32_t>> pending { { term, depth } };
+
+  while (!pending.empty()) {
+    auto [term, depth] = pending.back();
+    pending.pop_back();
+    const Cell &cell = cells[term];
+    if (cell.free <= depth) continue;
+
+    switch (cell.tag) {
+    case Tag::Variable:
+      indexes.insert(cell.a - depth);
+      break;
+    case Tag::Abstraction:
+      pending.push_back({ cell.a, depth + 1 });
+      break;
+    case Tag::Application:
+      pending.push_back({ cell.b, depth });
+      pending.push_back({ cell.a, depth });
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+thread_local std::vector<TermStore::Cell> TermStore::cells;
+thread_local std::unordered_map<TermStore::Index, std::pair<size_t, size_t>> TermStore::spans;
+thread_local std::unordered_map<Symbols::Id, TermStore::Index> TermStore::definitions;
+thread_local std::vector<TermStore::Task> TermStore::tasks;
+thread_local std::vector<TermStore::Index> TermStore::results;
+
+template <class Replace>
+TermStore::Index TermStore::rebuild(Index term, uint32_t depth, Replace replace) {
+  // Every step substitutes, so the stack is kept from call to call; the
+  // shifts that replace makes run on top of it. The walk goes down the
+  // function of an application first and comes back for its argument
+  size_t base = tasks.size();
+
+  // Parts with no binder or application to walk into are done on the spot
+  auto leaf = [&replace](Index part, uint32_t depth, Index &result) {
+    const Cell &cell = cells[part];
+    if (cell.free < depth) result = part;
+    else if (cell.tag == Tag::Variable) result = replace(cell.a, depth);
+    else if (cell.tag != Tag::Abstraction and cell.tag != Tag::Application) result = part;
+    else return false;
+    return true;
+  };
+
+  while (true) {
+    Index result;
+    if (!leaf(term, depth, result)) {
+      Cell cell = cells[term];
+      if (cell.tag == Tag::Abstraction) {
+        tasks.push_back({ Task::Kind::Bind, term, depth });
+        term = cell.a;
+        ++depth;
+        continue;
+      }
+
+      Index function, argument;
+      if (!leaf(cell.a, depth, function)) {
+        tasks.push_back({ Task::Kind::Apply, term, depth });
+        term = cell.a;
+        continue;
+      }
+      if (!leaf(cell.b, depth, argument)) {
+        tasks.push_back({ Task::Kind::Visit, function, 0 });
+        term = cell.b;
+        continue;
+      }
+      result = make_application(function, argument);
+    }
+
+    while (true) {
+      if (tasks.size() == base) return result;
+      Task &task = tasks.back();
+      if (task.kind == Task::Kind::Bind) {
+        result = make_abstraction(result, cells[task.term].b);
+      }
+      else if (task.kind == Task::Kind::Apply) {
+        // The task keeps the new function while the argument is visited
+        term = cells[task.term].b;
+        depth = task.depth;
+        task = { Task::Kind::Visit, result, 0 };
+        break;
+      }
+      else {
+        result = make_application(task.term, result);
+      }
+      tasks.pop_back();
+    }
+  }
+}
+
+TermStore::Index TermStore::shift(Index term, int offset, uint32_t cutoff) {
+  if (offset == 0) return term;
+  return rebuild(term, cutoff + 1, [offset](uint32_t index, uint32_t depth) {
+    return make_variable(index + offset);
+  });
+}
+
+TermStore::Index TermStore::substitute(Index body, Index argument, uint32_t depth) {
+  return rebuild(body, depth, [argument](uint32_t index, uint32_t depth) {
+    if (index == depth) return shift(argument, depth - 1);
+    return make_variable(index - 1);
+  });
+}
+
+bool TermStore::occurs(Index term, uint32_t index) {
+  std::vector<std::pair<Index, uint32_t>> pending { { term, index } };
+
+  while (!pending.empty()) {
+    auto [term, index] = pending.back();
+    pending.pop_back();
+    const Cell &cell = cells[term];
+    if (cell.free < index) continue;
+
+    switch (cell.tag) {
+    case Tag::Variable:
+      if (cell.a == index) return true;
+      break;
+    case Tag::Abstraction:
+      pending.push_back({ cell.a, index + 1 });
+      break;
+    case Tag::Application:
+      pending.push_back({ cell.b, index });
+      pending.push_back({ cell.a, index });
+      break;
+    default:
+      break;
+    }
+  }
+  return false;
+}
+
+bool TermStore::read_number(Index term, long long &value) {
+  if (cells[term].tag == Tag::Number) {
+    value = get_number(cells[term]);
+    return true;
+  }
+  if (cells[term].tag != Tag::Abstraction) return false;
+
+  Index body = cells[term].a;
+  if (cells[body].tag == Tag::Variable and cells[body].a == 1) {
+    value = 1;
+    return true;
+  }
+  if (cells[body].tag != Tag::Abstraction) return false;
+
+  long long count = 0;
+  body = cells[body].a;
+  while (cells[body].tag == Tag::Application
+    and cells[cells[body].a].tag == Tag::Variable
+    and cells[cells[body].a].a == 2) {
+    body = cells[body].b;
+    ++count;
+  }
+
+  if (cells[body].tag == Tag::Variable and cells[body].a == 1) {
+    value = count;
+    return true;
+  }
+  return false;
+}
+
+TermStore::Index TermStore::to_church(long long value) {
+  Index body = make_variable(1);
+  Index function = make_variable(2);
+  for (long long i = 0; i < value; ++i) {
+    body = make_application(function, body);
+  }
+  return make_abstraction(make_abstraction(body, Symbols::intern("x")), Symbols::intern("f"));
+}
+
+TermStore::Index TermStore::apply_operator(Index operation, Index left, Index right) {
+  left = normalize_term(resolve(left));
+  right = normalize_term(resolve(right));
+
+  long long left_value, right_value, result;
+  if (read_number(left, left_value) and read_number(right, right_value)) {
+    count_step(operation);
+    const char *message = AST::Operator::evaluate(cells[operation].symbol, left_value, right_value, result);
+    if (message) throw error(message, operation);
+    return make_number(result);
+  }
+
+  for (Index operand : { left, right }) {
+    if (cells[operand].tag == Tag::Abstraction)
+      throw error("Expected a number", operand);
+  }
+
+  return make_application(make_application(operation, left), right);
+}
+
+TermStore::Index TermStore::resolve(Index term) {
+  while (cells[term].tag == Tag::Constant) {
+    Symbols::Id name = cells[term].a;
+    auto entry = definitions.find(name);
+    if (entry == definitions.end()) {
+      AST::Node *value = AST::get_constant(name);
+      if (!value) break;
+      entry = definitions.insert({ name, import(value, false) }).first;
+    }
+    count_step(term);
+    term = entry->second;
+  }
+  return term;
+}
+
+TermStore::Index TermStore::whnf(Index term) {
+  // The spine is unwound into an argument stack so that head reduction runs
+  // in a loop instead of recursing once per step
+  std::vector<Index> arguments;
+  Index head = term;
+
+  while (true) {
+    while (cells[head].tag == Tag::Application) {
+      arguments.push_back(cells[head].b);
+      head = cells[head].a;
+    }
+    if (arguments.empty()) return head;
+
+    Cell cell = cells[head];
+    if (cell.tag == Tag::Abstraction) {
+      count_step(head);
+      head = substitute(cell.a, arguments.back());
+      arguments.pop_back();
+      continue;
+    }
+    else if (cell.tag == Tag::Constant) {
+      Index value = resolve(head);
+      if (value == head) break;
+      head = value;
+      continue;
+    }
+    else if (cell.tag == Tag::Number) {
+      long long value = get_number(cell);
+      if (value < 0)
+        throw error("Negative number applied as a Church numeral", head);
+      count_step(head);
+      head = to_church(value);
+      continue;
+    }
+    else if (cell.tag == Tag::Operator and arguments.size() >= 2) {
+      Index left = arguments.back();
+      arguments.pop_back();
+      Index right = arguments.back();
+      arguments.pop_back();
+      head = apply_operator(head, left, right);
+      if (cells[head].tag != Tag::Number) break;
+      continue;
+    }
+    break;
+  }
+
+  while (!arguments.empty()) {
+    head = make_application(head, arguments.back());
+    arguments.pop_back();
+  }
+  return head;
+}
+
+TermStore::Index TermStore::normalize_term(Index term) {
+  // Bind finishes the body of an abstraction, and Apply the arguments of an
+  // application, whose head is left as whnf gave it
+  size_t base = tasks.size();
+  tasks.push_back({ Task::Kind::Visit, term, 0 });
+
+  while (tasks.size() > base) {
+    Task task = tasks.back();
+    tasks.pop_back();
+    term = task.term;
+
+    if (task.kind == Task::Kind::Bind) {
+      Index body = results.back();
+      if (body != cells[term].a) term = make_abstraction(body, cells[term].b);
+      term = eta_reduce(term);
+    }
+    else if (task.kind == Task::Kind::Apply) {
+      std::vector<Index> arguments;
+      Index head = term;
+      while (cells[head].tag == Tag::Application) {
+        arguments.push_back(cells[head].b);
+        head = cells[head].a;
+      }
+
+      // The normal forms of the arguments are on the results, the first one
+      // first, while the spine lists them the other way round
+      size_t first = results.size() - arguments.size();
+      if (!std::equal(arguments.rbegin(), arguments.rend(), results.begin() + first)) {
+        term = head;
+        for (size_t i = first; i < results.size(); ++i) {
+          term = make_application(term, results[i]);
+        }
+      }
+      results.resize(first);
+    }
+    else {
+      if (cells[term].normal) {
+        results.push_back(term);
+        continue;
+      }
+      if (tasks.size() > max_nesting) throw error("Reduction too deep", term);
+      term = whnf(term);
+      Cell cell = cells[term];
+
+      if (cell.tag == Tag::Abstraction) {
+        tasks.push_back({ Task::Kind::Bind, term, 0 });
+        tasks.push_back({ Task::Kind::Visit, cell.a, 0 });
+        continue;
+      }
+      if (cell.tag == Tag::Application) {
+        tasks.push_back({ Task::Kind::Apply, term, 0 });
+        for (Index argument = term; cells[argument].tag == Tag::Application; argument = cells[argument].a) {
+          tasks.push_back({ Task::Kind::Visit, cells[argument].b, 0 });
+        }
+        continue;
+      }
+    }
+
+    cells[term].normal = true;
+    if (task.kind == Task::Kind::Bind) results.back() = term;
+    else results.push_back(term);
+  }
+
+  term = results.back();
+  results.pop_back();
+  return term;
+}
+
+TermStore::Index TermStore::eta_reduce(Index abstraction) {
+  Index body = cells[abstraction].a;
+  if (cells[body].tag != Tag::Application) return abstraction;
+
+  Index function = cells[body].a, argument = cells[body].b;
+  if (cells[argument].tag != Tag::Variable or cells[argument].a != 1) return abstraction;
+  if (occurs(function, 1)) return abstraction;
+
+  return shift(function, -1);
+}
+
+void TermStore::count_step(Index redex) {
+  if (++steps > max_steps)
+    throw error("Infinite lambda expression", redex);
+  if (steps % 256 != 0) return;
+  if (const char *message = AST::checkpoint(steps))
+    throw error(message, redex);
+}
+
+RuntimeException TermStore::error(const std::string message, Index term) {
+  auto entry = spans.find(term);
+  if (entry == spans.end()) entry = spans.find(root);
+  if (entry == spans.end()) return RuntimeException(message, 0, 0);
+  return RuntimeException(message, entry->second.first, entry->second.second);
+}
+
+thread_local size_t TermStore::steps;
+size_t TermStore::max_steps = 10000000;
+size_t TermStore::max_nesting = 1 << 22;
+thread_local TermStore::Index TermStore::root;
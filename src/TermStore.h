@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <cstdint>
+
+#include "AST.h"
+
+class TermStore {
+public:
+  typedef uint32_t Index;
+
+  enum class Tag : unsigned char {
+    Variable, Constant, Abstraction, Application, Number, Operator
+  };
+
+  // Variable: a = de Bruijn index
+  // Constant: a = symbol id
+  // Abstraction: a = body, b = symbol id
+  // Application: a = function, b = argument
+  // Number: a, b = low and high halves of the value
+  // Operator: symbol = operator character
+  class Cell {
+  public:
+    Tag tag;
+    char symbol;
+    bool normal;
+    uint32_t free;
+    uint32_t a;
+    uint32_t b;
+  };
+
+  static AST::Node *normalize(AST::Node *node);
+
+private:
+  TermStore() = default;
+
+  // STORE
+
+  static Index make(Tag tag, uint32_t a, uint32_t b, uint32_t free, char symbol = 0);
+  static Index make_variable(uint32_t index);
+  static Index make_abstraction(Index body, Symbols::Id name);
+  static Index make_application(Index function, Index argument);
+  static Index make_number(long long value);
+  static long long get_number(const Cell &cell);
+
+  static Index import(AST::Node *node, bool source = true);
+  static AST::Node *export_term(Index term, std::vector<Symbols::Id> &scope);
+  static void collect_free(Index term, uint32_t depth, std::set<uint32_t> &indexes);
+
+  static thread_local std::vector<Cell> cells;
+  static thread_local std::unordered_map<Index, std::pair<size_t, size_t>> spans;
+  static thread_local std::unordered_map<Symbols::Id, Index> definitions;
+
+  // REDUCING
+
+  // Pending work of a traversal: visiting a term, or building the
+  // abstraction or application whose parts were visited last
+  class Task {
+  public:
+    enum class Kind { Visit, Bind, Apply } kind;
+    Index term;
+    uint32_t depth;
+  };
+
+  // Copies term with every variable bound outside depth binders replaced
+  // by what replace gives for its index and the depth it is found at
+  template <class Replace>
+  static Index rebuild(Index term, uint32_t depth, Replace replace);
+  static Index shift(Index term, int offset, uint32_t cutoff = 0);
+  static Index substitute(Index body, Index argument, uint32_t depth = 1);
+  static bool occurs(Index term, uint32_t index);
+  static bool read_number(Index term, long long &value);
+  static Index to_church(long long value);
+  static Index apply_operator(Index operation, Index left, Index right);
+
+  static Index resolve(Index term);
+  static Index whnf(Index term);
+  static Index normalize_term(Index term);
+  static Index eta_reduce(Index abstraction);
+  static void count_step(Index redex);
+
+  static RuntimeException error(const std::string message, Index term);
+
+  static thread_local size_t steps;
+  static size_t max_steps;
+  // Pending tasks of a normalization, about two per level of nesting, so
+  // numerals of up to two million still fit
+  static size_t max_nesting;
+  static thread_local Index root;
+  // Shared by nested traversals, each above the tasks it found there
+  static thread_local std::vector<Task> tasks;
+  static thread_local std::vector<Index> results;
+};
@@ -0,0 +1,292 @@
+#include "TypeChecker.h"
+
+bool TypeChecker::infer(AST::Node *node, std::string &type) {
+  types.clear();
+  resolving.clear();
+  gave_up = false;
+  work = 0;
+
+  std::vector<Index> scope;
+  Index result = infer_term(node, scope);
+  if (result != none) {
+    std::unordered_map<Index, std::string> names;
+    size_t budget = max_length;
+    type = to_string(result, names, budget);
+  }
+
+  types.clear();
+  return result != none;
+}
+
+void TypeChecker::clear() {
+  schemes.clear();
+}
+
+TypeChecker::Index TypeChecker::make(Kind kind, Index a, Index b) {
+  // Types that keep doubling as constants are instantiated are given up on
+  // rather than exhausting memory
+  if (types.size() >= max_types) {
+    gave_up = true;
+    return none;
+  }
+  types.push_back({ kind, a, b });
+  return types.size() - 1;
+}
+
+TypeChecker::Index TypeChecker::make_variable() {
+  Index variable = make(Kind::Variable);
+  if (variable != none) types[variable].a = variable;
+  return variable;
+}
+
+TypeChecker::Index TypeChecker::find(Index type) {
+  while (types[type].kind == Kind::Variable and types[type].a != type) {
+    Index parent = types[type].a;
+    // Halve the path on the way, as in any union-find
+    if (types[parent].kind == Kind::Variable) types[type].a = types[parent].a;
+    type = parent;
+  }
+  return type;
+}
+
+bool TypeChecker::occurs(Index variable, Index type) {
+  if (++work > max_work) {
+    gave_up = true;
+    return true;
+  }
+  type = find(type);
+  if (type == variable) return true;
+  if (types[type].kind != Kind::Arrow) return false;
+  return occurs(variable, types[type].a) or occurs(variable, types[type].b);
+}
+
+bool TypeChecker::unify(Index left, Index right) {
+  // Shared parts of a type are walked once per path to them, so the work
+  // is bounded as well as the size
+  if (++work > max_work) {
+    gave_up = true;
+    return false;
+  }
+  left = find(left);
+  right = find(right);
+  if (left == right) return true;
+
+  if (types[left].kind == Kind::Variable) {
+    if (occurs(left, right)) return false;
+    types[left].a = right;
+    return true;
+  }
+  if (types[right].kind == Kind::Variable) return unify(right, left);
+
+  if (types[left].kind != types[right].kind) return false;
+  if (types[left].kind == Kind::Integer) return true;
+  Index right_result = types[right].b;
+  return unify(types[left].a, types[right].a) and unify(types[left].b, right_result);
+}
+
+TypeChecker::Index TypeChecker::infer_term(AST::Node *node, std::vector<Index> &scope) {
+  // Terms nest as deep as any numeral, so the pending work is kept on a
+  // stack: a task either infers a term, closes an abstraction over the type
+  // of its body, applies a function to an argument, or ends an assignment.
+  // A term without a type leaves nothing to finish, so that gives up at once
+  class Task {
+  public:
+    enum class Kind { Infer, Abstract, Apply, Assign } kind;
+    AST::Node *node;
+    Index type;
+  };
+  std::vector<Task> tasks { { Task::Kind::Infer, node, none } };
+  std::vector<Index> results;
+
+  while (!tasks.empty()) {
+    Task task = tasks.back();
+    tasks.pop_back();
+
+    switch (task.kind) {
+    case Task::Kind::Abstract: {
+      scope.pop_back();
+      Index arrow = make(Kind::Arrow, task.type, results.back());
+      if (arrow == none) return none;
+      results.back() = arrow;
+      continue;
+    }
+    case Task::Kind::Apply: {
+      Index argument = results.back();
+      results.pop_back();
+      Index result = make_variable();
+      if (result == none) return none;
+      Index arrow = make(Kind::Arrow, argument, result);
+      if (arrow == none or !unify(results.back(), arrow)) return none;
+      results.back() = result;
+      continue;
+    }
+    case Task::Kind::Assign:
+      resolving.pop_back();
+      continue;
+    default:
+      break;
+    }
+
+    node = task.node->view();
+    Index type = none;
+    switch (node->get_type()) {
+    case AST::Node::Type::Variable: {
+      size_t index = ((AST::Variable *) node)->bruijn_index;
+      type = index == 0 or index > scope.size() ? make_variable() : scope[scope.size() - index];
+      break;
+    }
+    case AST::Node::Type::Constant:
+      type = infer_constant(((AST::Constant *) node)->name);
+      break;
+    case AST::Node::Type::Abstraction: {
+      Index argument = make_variable();
+      if (argument == none) return none;
+      scope.push_back(argument);
+      tasks.push_back({ Task::Kind::Abstract, node, argument });
+      tasks.push_back({ Task::Kind::Infer, ((AST::Abstraction *) node)->term, none });
+      continue;
+    }
+    case AST::Node::Type::Application:
+      tasks.push_back({ Task::Kind::Apply, node, none });
+      tasks.push_back({ Task::Kind::Infer, ((AST::Application *) node)->term2, none });
+      tasks.push_back({ Task::Kind::Infer, ((AST::Application *) node)->term1, none });
+      continue;
+    case AST::Node::Type::Assignment:
+      // Constants are referred to by name, so a definition that uses its own
+      // name is recursive even before it is set
+      resolving.push_back(((AST::Assignment *) node)->name);
+      tasks.push_back({ Task::Kind::Assign, node, none });
+      tasks.push_back({ Task::Kind::Infer, ((AST::Assignment *) node)->term, none });
+      continue;
+    case AST::Node::Type::Number:
+      type = make(Kind::Integer);
+      break;
+    case AST::Node::Type::Operator: {
+      Index integer = make(Kind::Integer);
+      if (integer == none) return none;
+      Index partial = make(Kind::Arrow, integer, integer);
+      if (partial == none) return none;
+      type = make(Kind::Arrow, integer, partial);
+      break;
+    }
+    default:
+      break;
+    }
+    if (type == none) return none;
+    results.push_back(type);
+  }
+  return results.back();
+}
+
+TypeChecker::Index TypeChecker::infer_constant(Symbols::Id name) {
+  AST::Node *value = AST::get_constant(name);
+  // A constant without a definition never reduces, so it can stand for
+  // anything. One that is being resolved, or defined, is recursive
+  for (Symbols::Id outer : resolving) {
+    if (outer == name) return none;
+  }
+  if (!value) return make_variable();
+
+  // A type stays valid while neither the constant nor anything it refers
+  // to, directly or not, was set again
+  uint64_t revision = AST::revision(name);
+  auto entry = schemes.find(name);
+  if (entry != schemes.end() and entry->second.revision == revision) {
+    if (entry->second.type.empty()) return none;
+    return instantiate(entry->second.type);
+  }
+
+  // Chains of definitions deeper than this would overflow the stack
+  if (resolving.size() >= max_depth) {
+    gave_up = true;
+    return none;
+  }
+
+  resolving.push_back(name);
+  std::vector<Index> scope;
+  Index type = infer_term(value, scope);
+  resolving.pop_back();
+
+  // Limits depend on the term being checked, so hitting one says nothing
+  // about the constant itself
+  if (!gave_up) store(name, revision, type);
+  return type;
+}
+
+void TypeChecker::store(Symbols::Id name, uint64_t revision, Index type) {
+  Scheme scheme { revision, {} };
+  if (type != none) {
+    std::unordered_map<Index, Index> copies;
+    freeze(type, scheme.type, copies);
+  }
+  schemes[name] = std::move(scheme);
+}
+
+TypeChecker::Index TypeChecker::freeze(Index type, std::vector<Type> &frozen, std::unordered_map<Index, Index> &copies) {
+  type = find(type);
+  auto entry = copies.find(type);
+  if (entry != copies.end()) return entry->second;
+
+  Type copy = types[type];
+  if (copy.kind == Kind::Arrow) {
+    copy.a = freeze(copy.a, frozen, copies);
+    copy.b = freeze(types[type].b, frozen, copies);
+  }
+  Index index = frozen.size();
+  if (copy.kind == Kind::Variable) copy.a = index;
+  frozen.push_back(copy);
+  copies.insert({ type, index });
+  return index;
+}
+
+TypeChecker::Index TypeChecker::instantiate(const std::vector<Type> &frozen) {
+  // Definitions are closed, so every variable left in their type is free to
+  // be chosen again at each use. Parts come before the types made of them,
+  // so one pass shifting every index copies the whole type, sharing and all
+  if (types.size() + frozen.size() > max_types) {
+    gave_up = true;
+    return none;
+  }
+  Index base = types.size();
+  for (const Type &type : frozen) {
+    types.push_back({ type.kind, base + type.a, base + type.b });
+  }
+  return types.size() - 1;
+}
+
+std::string TypeChecker::to_string(Index type, std::unordered_map<Index, std::string> &names, size_t &budget, bool left) {
+  // Shared parts are spelled out in full, which can double the text at
+  // every level
+  if (budget == 0) return "...";
+  --budget;
+
+  type = find(type);
+  switch (types[type].kind) {
+  case Kind::Variable: {
+    auto entry = names.find(type);
+    if (entry != names.end()) return entry->second;
+    size_t count = names.size();
+    std::string name(1, 'a' + count % 26);
+    if (count >= 26) name += std::to_string(count / 26);
+    names.insert({ type, name });
+    return name;
+  }
+  case Kind::Arrow: {
+    std::string argument = to_string(types[type].a, names, budget, true);
+    std::string arrow = argument + " -> " + to_string(types[type].b, names, budget);
+    return left ? "(" + arrow + ")" : arrow;
+  }
+  default:
+    return "Int";
+  }
+}
+
+thread_local std::vector<TypeChecker::Type> TypeChecker::types;
+thread_local std::unordered_map<Symbols::Id, TypeChecker::Scheme> TypeChecker::schemes;
+thread_local std::vector<Symbols::Id> TypeChecker::resolving;
+thread_local bool TypeChecker::gave_up;
+thread_local size_t TypeChecker::work;
+size_t TypeChecker::max_types = 1 << 22;
+size_t TypeChecker::max_work = 1 << 24;
+size_t TypeChecker::max_depth = 10000;
+size_t TypeChecker::max_length = 1000;
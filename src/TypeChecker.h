@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "AST.h"
+
+// Infers simple types, with constants inlined and generalised at each use
+// as let-bound names would be. Simply typed terms always reach a normal
+// form, so the evaluator can skip its divergence checks for them
+class TypeChecker {
+public:
+  typedef uint32_t Index;
+
+  enum class Kind : unsigned char {
+    Variable, Arrow, Integer
+  };
+
+  // Variable: a = the type it was unified with, or itself while unbound
+  // Arrow: a = argument, b = result
+  class Type {
+  public:
+    Kind kind;
+    Index a;
+    Index b;
+  };
+
+  // Fills in the type of the term, or returns false if it has none
+  static bool infer(AST::Node *node, std::string &type);
+  static void clear();
+
+private:
+  TypeChecker() = default;
+
+  // A constant's type, kept from one statement to the next until the
+  // constant's revision changes. Types are stored children first, with the
+  // whole type last; an empty type means the constant has none
+  class Scheme {
+  public:
+    uint64_t revision;
+    std::vector<Type> type;
+  };
+
+  static const Index none = UINT32_MAX;
+
+  static Index make(Kind kind, Index a = 0, Index b = 0);
+  static Index make_variable();
+  static Index find(Index type);
+  static bool occurs(Index variable, Index type);
+  static bool unify(Index left, Index right);
+
+  static Index infer_term(AST::Node *node, std::vector<Index> &scope);
+  static Index infer_constant(Symbols::Id name);
+  static void store(Symbols::Id name, uint64_t revision, Index type);
+  static Index freeze(Index type, std::vector<Type> &frozen, std::unordered_map<Index, Index> &copies);
+  static Index instantiate(const std::vector<Type> &frozen);
+
+  static std::string to_string(Index type, std::unordered_map<Index, std::string> &names, size_t &budget, bool left = false);
+
+  static thread_local std::vector<Type> types;
+  static thread_local std::unordered_map<Symbols::Id, Scheme> schemes;
+  // Constants whose types are being inferred, which are recursive if met
+  // again
+  static thread_local std::vector<Symbols::Id> resolving;
+  // Set when a limit below is hit, so that nothing is kept from the attempt
+  static thread_local bool gave_up;
+  static thread_local size_t work;
+  static size_t max_types;
+  static size_t max_work;
+  static size_t max_depth;
+  static size_t max_length;
+};